@@ -0,0 +1,255 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysinfo.h>
+#include <unistd.h>
+#include "rle.h"
+
+#define CHUNK_SIZE (4 << 20)    // input bytes compressed as one piece of work
+#define WINDOW_PER_THREAD 4     // chunks allowed ahead of the writer, per thread
+#define STAGE_SIZE (1 << 20)    // small outputs are gathered before writing
+
+// A piece of one input file, and its compressed runs once a worker is done
+typedef struct {
+	const unsigned char *in;
+	size_t len;
+	char *out;
+	size_t out_len;
+	bool done;
+} chunk_t;
+
+// A run held back by the writer, since the next chunk may continue it
+typedef struct {
+	uint32_t count;
+	unsigned char c;
+} run_t;
+
+const unsigned char *map_file(const char *, size_t *);
+void add_chunks(const unsigned char *, size_t);
+void *compress_chunks(void *);
+void write_chunk(chunk_t *, run_t *);
+void put_run(run_t *);
+void put(const void *, size_t);
+void flush_stage(void);
+void write_all(const void *, size_t);
+void usage(void);
+
+chunk_t *chunks = NULL;
+size_t nchunks = 0, chunks_cap = 0;
+
+// next chunk to hand out, and the first one not yet written; a worker may
+// only run window chunks ahead of the writer, which bounds memory use
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t chunk_done = PTHREAD_COND_INITIALIZER;
+pthread_cond_t window_open = PTHREAD_COND_INITIALIZER;
+size_t next_chunk = 0, written = 0, window = 0;
+
+char stage[STAGE_SIZE];
+size_t staged = 0;
+
+
+int main(int argc, char *argv[]) {
+	if (argc < 2) usage();
+
+	// all inputs are compressed as one stream; map them all up front
+	for (int i = 1; i < argc; ++i) {
+		size_t len;
+		const unsigned char *data = map_file(argv[i], &len);
+		if (data == NULL) {
+			printf("pzip: cannot open file\n");
+			exit(1);
+		}
+		add_chunks(data, len);
+	}
+
+	// workers take the next chunk whenever they are free, so a slow
+	// thread simply ends up doing fewer of them
+	int nthreads = get_nprocs();
+	if (nthreads > nchunks) nthreads = nchunks;
+	window = (size_t) WINDOW_PER_THREAD * (nthreads > 0 ? nthreads : 1);
+	pthread_t *threads = malloc(sizeof(pthread_t) * (nthreads > 0 ? nthreads : 1));
+	for (int i = 0; i < nthreads; ++i) {
+		pthread_create(&threads[i], NULL, compress_chunks, NULL);
+	}
+
+	// meanwhile, write the chunks out in order as they finish
+	run_t pending = { 0, 0 };
+	for (size_t i = 0; i < nchunks; ++i) {
+		pthread_mutex_lock(&lock);
+		while (!chunks[i].done) pthread_cond_wait(&chunk_done, &lock);
+		pthread_mutex_unlock(&lock);
+
+		write_chunk(&chunks[i], &pending);
+		free(chunks[i].out);
+
+		pthread_mutex_lock(&lock);
+		written = i + 1;
+		pthread_cond_broadcast(&window_open);
+		pthread_mutex_unlock(&lock);
+	}
+	put_run(&pending);
+	flush_stage();
+
+	for (int i = 0; i < nthreads; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+	free(chunks);
+	return 0;
+}
+
+
+// Maps a file read-only and returns its contents, or NULL if it cannot be
+// opened. Files that cannot be mapped (pipes, terminals) are read instead.
+const unsigned char *map_file(const char *name, size_t *lenp) {
+	int fd = open(name, O_RDONLY);
+	struct stat sb;
+	if (fd < 0 || fstat(fd, &sb) < 0) return NULL;
+
+	*lenp = 0;
+	if (S_ISREG(sb.st_mode)) {
+		*lenp = sb.st_size;
+		if (*lenp == 0) {
+			close(fd);
+			return (const unsigned char *) "";
+		}
+		void *p = mmap(NULL, *lenp, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (p == MAP_FAILED) return NULL;
+		madvise(p, *lenp, MADV_SEQUENTIAL);
+		return p;
+	}
+
+	size_t cap = CHUNK_SIZE;
+	unsigned char *buf = malloc(cap);
+	ssize_t n;
+	while ((n = read(fd, buf + *lenp, cap - *lenp)) > 0) {
+		*lenp += n;
+		if (*lenp == cap) buf = realloc(buf, cap *= 2);
+	}
+	close(fd);
+	return buf;
+}
+
+
+// Splits one input into chunks of work, in stream order
+void add_chunks(const unsigned char *data, size_t len) {
+	for (size_t off = 0; off < len; off += CHUNK_SIZE) {
+		if (nchunks == chunks_cap) {
+			chunks_cap = chunks_cap ? chunks_cap * 2 : 64;
+			chunks = realloc(chunks, sizeof(chunk_t) * chunks_cap);
+		}
+		chunk_t *c = &chunks[nchunks++];
+		c->in = data + off;
+		c->len = len - off < CHUNK_SIZE ? len - off : CHUNK_SIZE;
+		c->out = NULL;
+		c->out_len = 0;
+		c->done = false;
+	}
+}
+
+
+void *compress_chunks(void *arg) {
+	while (true) {
+		pthread_mutex_lock(&lock);
+		while (next_chunk < nchunks && next_chunk >= written + window) {
+			pthread_cond_wait(&window_open, &lock);
+		}
+		if (next_chunk == nchunks) {
+			pthread_mutex_unlock(&lock);
+			return NULL;
+		}
+		chunk_t *c = &chunks[next_chunk++];
+		pthread_mutex_unlock(&lock);
+
+		// worst case is a record per byte; untouched pages cost nothing.
+		// A chunk is at most CHUNK_SIZE bytes, so no run overflows its count.
+		c->out = malloc(c->len * RLE_RECORD);
+		c->out_len = rle_encode(c->in, c->len, c->out);
+
+		pthread_mutex_lock(&lock);
+		c->done = true;
+		pthread_cond_signal(&chunk_done);
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+
+// Writes a chunk's records, joining its first run onto the pending one
+// and holding back its last, which the next chunk may carry on
+void write_chunk(chunk_t *c, run_t *pending) {
+	size_t nrecords = c->out_len / RLE_RECORD;
+	char *first = c->out, *last = c->out + c->out_len - RLE_RECORD;
+	run_t head;
+	memcpy(&head.count, first, sizeof(head.count));
+	head.c = first[4];
+
+	if (pending->count > 0 && pending->c == head.c
+	    && (uint64_t) pending->count + head.count <= UINT32_MAX) {
+		pending->count += head.count;
+	} else {
+		put_run(pending);
+		*pending = head;
+	}
+	if (nrecords == 1) return;
+
+	put_run(pending);
+	put(first + RLE_RECORD, last - first - RLE_RECORD);
+	memcpy(&pending->count, last, sizeof(pending->count));
+	pending->c = last[4];
+}
+
+
+void put_run(run_t *run) {
+	if (run->count == 0) return;
+	char record[RLE_RECORD];
+	memcpy(record, &run->count, sizeof(run->count));
+	record[4] = run->c;
+	put(record, RLE_RECORD);
+}
+
+
+// Gathers small pieces of output; large ones go straight out
+void put(const void *p, size_t len) {
+	if (staged + len > STAGE_SIZE || len >= STAGE_SIZE / 2) flush_stage();
+	if (len >= STAGE_SIZE / 2) {
+		write_all(p, len);
+		return;
+	}
+	memcpy(stage + staged, p, len);
+	staged += len;
+}
+
+
+void flush_stage(void) {
+	write_all(stage, staged);
+	staged = 0;
+}
+
+
+void write_all(const void *p, size_t len) {
+	const char *s = p;
+	while (len > 0) {
+		ssize_t n = write(STDOUT_FILENO, s, len);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0) {
+			perror("pzip: write");
+			exit(1);
+		}
+		s += n;
+		len -= n;
+	}
+}
+
+
+void usage(void) {
+	printf("pzip: file1 [file2 ...]\n");
+	exit(1);
+}
@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "rle.h"
+
+#define MIN_BYTES (256 << 20)   // input each kernel chews through per file
+#define MIN_SECS 0.2            // ... and at least this long
+#define BATCH_BYTES (1 << 20)   // input encoded between reading the clock
+
+char *read_whole(const char *, size_t *);
+double now(void);
+
+const char *names[] = { "bytewise", "swar", "sse2", "avx2" };
+#define NNAMES (sizeof(names) / sizeof(names[0]))
+
+
+// ./rle-bench file...
+//
+// Times every kernel the CPU supports on each file (encoding it over and
+// over, since test inputs are small) and checks they all agree with the
+// plain byte-at-a-time loop.
+int main(int argc, char *argv[]) {
+	if (argc < 2) {
+		printf("rle-bench: file1 [file2 ...]\n");
+		exit(1);
+	}
+
+	printf("%-24s %10s %10s %10s %10s %8s\n", "file", "bytes", "runs", "kernel", "MB/s", "speedup");
+	for (int f = 1; f < argc; ++f) {
+		size_t len;
+		char *data = read_whole(argv[f], &len);
+		if (data == NULL) {
+			printf("rle-bench: cannot open file\n");
+			exit(1);
+		}
+		if (len == 0) continue;
+
+		char *expected = malloc(len * RLE_RECORD);
+		char *out = malloc(len * RLE_RECORD);
+		rle_use("bytewise");
+		size_t expected_len = rle_encode((unsigned char *) data, len, expected);
+
+		const char *base_name = strrchr(argv[f], '/') ? strrchr(argv[f], '/') + 1 : argv[f];
+		double base_rate = 0;
+		for (int k = 0; k < NNAMES; ++k) {
+			if (rle_use(names[k]) < 0) continue;
+
+			size_t out_len = rle_encode((unsigned char *) data, len, out);
+			if (out_len != expected_len || memcmp(out, expected, out_len) != 0) {
+				printf("rle-bench: %s disagrees with bytewise on %s\n", names[k], argv[f]);
+				exit(1);
+			}
+
+			// repeat until enough bytes and time have gone by to trust the
+			// clock, reading it only once per megabyte or so
+			size_t done = 0, reps = len < BATCH_BYTES ? BATCH_BYTES / len : 1;
+			double start = now(), secs;
+			do {
+				for (size_t r = 0; r < reps; ++r) {
+					rle_encode((unsigned char *) data, len, out);
+				}
+				done += reps * len;
+				secs = now() - start;
+			} while (done < MIN_BYTES || secs < MIN_SECS);
+			double rate = done / secs / 1e6;
+			if (k == 0) base_rate = rate;
+			printf("%-24s %10zu %10zu %10s %10.0f %7.2fx\n", base_name, len,
+			       expected_len / RLE_RECORD, names[k], rate, rate / base_rate);
+		}
+		free(expected);
+		free(out);
+		free(data);
+	}
+	return 0;
+}
+
+
+char *read_whole(const char *name, size_t *lenp) {
+	FILE *fp = fopen(name, "r");
+	struct stat sb;
+	if (fp == NULL || fstat(fileno(fp), &sb) < 0) return NULL;
+	char *data = malloc(sb.st_size > 0 ? sb.st_size : 1);
+	*lenp = fread(data, 1, sb.st_size, fp);
+	fclose(fp);
+	return data;
+}
+
+
+double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,149 @@
+#include <stdint.h>
+#include <string.h>
+#include "rle.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RLE_X86 1
+#endif
+
+// Each kernel finds where the run of c that continues at in[i] ends, i.e.
+// the first j >= i with in[j] != c (or len). The encoders are stamped out
+// once per kernel so the search inlines into the loop around it; a call
+// through a pointer per run would cost more than short runs take. The
+// second byte of a run is checked with a plain branch first: for runs of
+// one, which are common, it is predicted and costs almost nothing, where
+// a kernel's load, compare and ctz would sit in the path of every run.
+#define RLE_ENCODER(name, run_end) \
+	static size_t name(const unsigned char *in, size_t len, char *out) { \
+		char *o = out; \
+		size_t i = 0; \
+		while (i < len) { \
+			unsigned char c = in[i]; \
+			size_t j = i + 1; \
+			if (j < len && in[j] == c) j = run_end(in, j + 1, len, c); \
+			uint32_t count = j - i; \
+			memcpy(o, &count, sizeof(count)); \
+			o[4] = c; \
+			o += RLE_RECORD; \
+			i = j; \
+		} \
+		return o - out; \
+	}
+
+typedef size_t (*encoder_t)(const unsigned char *, size_t, char *);
+
+
+// The plain loop: one compare per byte
+static inline size_t run_end_bytewise(const unsigned char *in, size_t i, size_t len, unsigned char c) {
+	while (i < len && in[i] == c) ++i;
+	return i;
+}
+
+
+// Eight bytes at a time in a general register: XOR against c repeated,
+// and the lowest nonzero byte of the result is the first that differs
+static inline size_t run_end_swar(const unsigned char *in, size_t i, size_t len, unsigned char c) {
+	uint64_t pattern = 0x0101010101010101ULL * c;
+	for (; i + 8 <= len; i += 8) {
+		uint64_t word;
+		memcpy(&word, in + i, sizeof(word));
+		uint64_t diff = word ^ pattern;
+		if (diff) return i + (__builtin_ctzll(diff) >> 3);
+	}
+	return run_end_bytewise(in, i, len, c);
+}
+
+RLE_ENCODER(encode_bytewise, run_end_bytewise)
+RLE_ENCODER(encode_swar, run_end_swar)
+
+
+#ifdef RLE_X86
+// 16 bytes per compare; movemask gives a bit per byte, clear where they
+// differ from c, so the first clear bit is the end of the run
+__attribute__((target("sse2")))
+static inline size_t run_end_sse2(const unsigned char *in, size_t i, size_t len, unsigned char c) {
+	__m128i pattern = _mm_set1_epi8(c);
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (in + i));
+		unsigned diff = ~_mm_movemask_epi8(_mm_cmpeq_epi8(v, pattern)) & 0xffff;
+		if (diff) return i + __builtin_ctz(diff);
+	}
+	return run_end_swar(in, i, len, c);
+}
+
+
+// The same, 32 bytes per compare
+__attribute__((target("avx2")))
+static inline size_t run_end_avx2(const unsigned char *in, size_t i, size_t len, unsigned char c) {
+	__m256i pattern = _mm256_set1_epi8(c);
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) (in + i));
+		unsigned diff = ~(unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, pattern));
+		if (diff) return i + __builtin_ctz(diff);
+	}
+	return run_end_sse2(in, i, len, c);
+}
+
+__attribute__((target("sse2"))) RLE_ENCODER(encode_sse2, run_end_sse2)
+__attribute__((target("avx2"))) RLE_ENCODER(encode_avx2, run_end_avx2)
+#endif
+
+
+static struct {
+	const char *name;
+	encoder_t encode;
+} kernels[] = {
+#ifdef RLE_X86
+	{ "avx2", encode_avx2 },
+	{ "sse2", encode_sse2 },
+#endif
+	{ "swar", encode_swar },
+	{ "bytewise", encode_bytewise },
+};
+
+#define NKERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+// set before main() runs, to the first (best) kernel the CPU supports
+static int current = NKERNELS - 1;
+
+
+static int supported(int k) {
+#ifdef RLE_X86
+	if (kernels[k].encode == encode_avx2) return __builtin_cpu_supports("avx2");
+	if (kernels[k].encode == encode_sse2) return __builtin_cpu_supports("sse2");
+#endif
+	return 1;
+}
+
+
+__attribute__((constructor))
+static void rle_init(void) {
+#ifdef RLE_X86
+	__builtin_cpu_init();
+#endif
+	for (int k = NKERNELS - 1; k >= 0; --k) {
+		if (supported(k)) current = k;
+	}
+}
+
+
+int rle_use(const char *name) {
+	for (int k = 0; k < NKERNELS; ++k) {
+		if (strcmp(kernels[k].name, name) == 0 && supported(k)) {
+			current = k;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+
+const char *rle_kernel(void) {
+	return kernels[current].name;
+}
+
+
+size_t rle_encode(const unsigned char *in, size_t len, char *out) {
+	return kernels[current].encode(in, len, out);
+}
@@ -0,0 +1,18 @@
+#ifndef __RLE_H__
+#define __RLE_H__
+
+#include <stddef.h>
+
+#define RLE_RECORD 5    // 4-byte run length + the character
+
+// Writes the runs of in[0..len) to out (room for len records) as records
+// and returns the bytes written. Runs must fit in 32 bits.
+size_t rle_encode(const unsigned char *in, size_t len, char *out);
+
+// Picks the kernel rle_encode uses: "bytewise", "swar", "sse2" or "avx2".
+// The best one the CPU supports is picked at startup; returns -1 if the
+// one asked for is unknown or not supported here.
+int rle_use(const char *name);
+const char *rle_kernel(void);
+
+#endif // __RLE_H__
@@ -0,0 +1,153 @@
+#! /bin/bash
+#
+# bench.sh: compare server configurations on the same workload.
+#
+# Builds a synthetic docroot, replays one request trace against wserver
+# under every combination of thread count, buffer count and scheduling
+# policy, and prints a table of throughput and latency percentiles.
+# Run through "make bench"; everything is set from the environment:
+#
+#   SIZES        files to generate, as bytes:count pairs
+#   REQUESTS     length of the generated trace
+#   CGI_SHARE    percentage of requests that go to busy.cgi ...
+#   CGI_MS       ... and how many milliseconds of CPU each burns
+#   TRACE        replay this trace (URIs or a wserver -l access log)
+#                instead of generating one
+#   THREADS, BUFFERS, POLICIES
+#                the configurations to compare (all combinations)
+#   CONCURRENCY  client connections (wload threads)
+#   DURATION     cap on seconds per run
+#   KEEPALIVE    1 to reuse connections
+#   SERVER_OPTS  extra wserver options, e.g. "-c 64" or "-e epoll"
+#   BENCH_DIR    where the docroot goes (default: a new temp dir)
+#   BENCH_PORT   port to run the server on
+#   KEEPALIVE_LIMIT_US
+#                p99.9 latency the keep-alive check below fails above
+#
+# After the table, one keep-alive client fetches an uncached file whose
+# last segment is short, under each engine. A reply held back by Nagle
+# until the client's delayed ACK shows up there as ~40 ms at p99.9, and
+# the script then exits with an error.
+#
+
+SIZES=${SIZES:-"512:40 4096:30 65536:20 1048576:8 8388608:2"}
+REQUESTS=${REQUESTS:-5000}
+CGI_SHARE=${CGI_SHARE:-5}
+CGI_MS=${CGI_MS:-5}
+THREADS=${THREADS:-"1 4 8"}
+BUFFERS=${BUFFERS:-"1 16"}
+POLICIES=${POLICIES:-"FIFO SFF SFNF"}
+CONCURRENCY=${CONCURRENCY:-16}
+DURATION=${DURATION:-30}
+KEEPALIVE=${KEEPALIVE:-0}
+SERVER_OPTS=${SERVER_OPTS:-""}
+BENCH_PORT=${BENCH_PORT:-18080}
+KEEPALIVE_LIMIT_US=${KEEPALIVE_LIMIT_US:-10000}
+BENCH_DIR=${BENCH_DIR:-$(mktemp -d /tmp/wserver-bench.XXXXXX)}
+
+here=$(cd "$(dirname "$0")" && pwd)
+
+# docroot: file<size>-<n>.bin for each size class, plus busy.cgi
+make_docroot() {
+    mkdir -p "$BENCH_DIR" || exit 1
+    files=()
+    for pair in $SIZES; do
+	size=${pair%%:*}
+	count=${pair##*:}
+	for ((i = 0; i < count; i++)); do
+	    name=file$size-$i.bin
+	    [ -f "$BENCH_DIR/$name" ] || head -c "$size" /dev/urandom > "$BENCH_DIR/$name"
+	    files+=("/$name")
+	done
+    done
+    cp "$here/busy.cgi" "$BENCH_DIR/busy.cgi" || exit 1
+    # 135000 bytes: not a whole number of segments
+    [ -f "$BENCH_DIR/keepalive.bin" ] || head -c 135000 /dev/urandom > "$BENCH_DIR/keepalive.bin"
+}
+
+# trace: files picked uniformly, with CGI_SHARE% of requests to busy.cgi
+make_trace() {
+    RANDOM=1 # same trace every time
+    for ((i = 0; i < REQUESTS; i++)); do
+	if ((RANDOM % 100 < CGI_SHARE)); then
+	    echo "/busy.cgi?$CGI_MS"
+	else
+	    echo "${files[RANDOM % ${#files[@]}]}"
+	fi
+    done > "$BENCH_DIR/trace"
+    TRACE=$BENCH_DIR/trace
+}
+
+wait_for_server() {
+    for ((i = 0; i < 100; i++)); do
+	(exec 3<>/dev/tcp/127.0.0.1/$BENCH_PORT) 2>/dev/null && return 0
+	sleep 0.05
+    done
+    return 1
+}
+
+# pulls one number out of wload's JSON report
+json_field() {
+    sed -n "s/.*\"$1\": \([0-9.]*\).*/\1/p" "$2"
+}
+
+# checks keep-alive replies are not stalled; returns 1 if one was
+keepalive_check() {
+    failed=0
+    printf "%7s %9s %9s %9s\n" engine p50_us p99_us p99.9_us
+    for e in pool epoll; do
+	"$here/wserver" -d "$BENCH_DIR" -p "$BENCH_PORT" -e "$e" > /dev/null 2>&1 &
+	server=$!
+	if ! wait_for_server; then
+	    echo "bench: wserver did not start" 1>&2
+	    kill $server 2> /dev/null
+	    return 1
+	fi
+	"$here/wload" -t 1 -d 2 -k -J "$BENCH_DIR/result.json" 127.0.0.1 "$BENCH_PORT" \
+	    /keepalive.bin > /dev/null
+	kill $server
+	wait $server 2> /dev/null
+	r=$BENCH_DIR/result.json
+	p=$(json_field p99.9 "$r")
+	printf "%7s %9s %9s %9s\n" "$e" "$(json_field p50 "$r")" "$(json_field p99 "$r")" "$p"
+	if [ "${p%.*}" -gt "$KEEPALIVE_LIMIT_US" ]; then
+	    echo "bench: keep-alive p99.9 under -e $e is over $KEEPALIVE_LIMIT_US us" 1>&2
+	    failed=1
+	fi
+    done
+    return $failed
+}
+
+make_docroot
+[ -n "$TRACE" ] || make_trace
+if [ "$KEEPALIVE" = 1 ]; then keepalive=-k; else keepalive=; fi
+
+echo "docroot: $BENCH_DIR  trace: $TRACE ($(wc -l < "$TRACE") requests)"
+echo "concurrency: $CONCURRENCY  server options: ${SERVER_OPTS:-none}"
+printf "%7s %7s %6s %10s %9s %9s %9s %9s %7s\n" \
+    threads buffers policy "req/s" mean_us p50_us p99_us p99.9_us errors
+for t in $THREADS; do
+    for b in $BUFFERS; do
+	for s in $POLICIES; do
+	    "$here/wserver" -d "$BENCH_DIR" -p "$BENCH_PORT" -t "$t" -b "$b" -s "$s" $SERVER_OPTS \
+		> /dev/null 2>&1 &
+	    server=$!
+	    if ! wait_for_server; then
+		echo "bench: wserver did not start" 1>&2
+		kill $server 2> /dev/null
+		exit 1
+	    fi
+	    "$here/wload" -t "$CONCURRENCY" -d "$DURATION" $keepalive -T "$TRACE" \
+		-J "$BENCH_DIR/result.json" 127.0.0.1 "$BENCH_PORT" > /dev/null
+	    kill $server
+	    wait $server 2> /dev/null
+	    r=$BENCH_DIR/result.json
+	    printf "%7s %7s %6s %10s %9s %9s %9s %9s %7s\n" "$t" "$b" "$s" \
+		"$(json_field throughput "$r")" "$(json_field mean "$r")" "$(json_field p50 "$r")" \
+		"$(json_field p99 "$r")" "$(json_field p99.9 "$r")" "$(json_field errors "$r")"
+	done
+    done
+done
+
+echo "keep-alive check: one client, uncached /keepalive.bin"
+keepalive_check || exit 1
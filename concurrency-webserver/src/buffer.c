@@ -0,0 +1,213 @@
+#include "io_helper.h"
+#include "buffer.h"
+#include "stats.h"
+
+static char *policy_names[] = { "FIFO", "SFF", "SFNF" };
+
+int buffer_parse_policy(const char *name) {
+    for (int i = 0; i < sizeof(policy_names) / sizeof(policy_names[0]); i++)
+	if (strcasecmp(name, policy_names[i]) == 0)
+	    return i;
+    return -1;
+}
+
+const char *buffer_policy_name(int policy) {
+    return policy_names[policy];
+}
+
+static double now_seconds() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double) t.tv_sec + (double) t.tv_nsec / 1e9;
+}
+
+void buffer_init(buffer_t *b, int size, int policy) {
+    b->policy = policy;
+    b->slots = malloc_or_die(sizeof(buffer_slot_t) * size);
+    b->heap = malloc_or_die(sizeof(int) * size);
+    b->size = size;
+    b->count = 0;
+    for (int i = 0; i < size; i++)
+	b->slots[i].next = (i + 1 < size) ? i + 1 : -1;
+    b->free_head = 0;
+    b->oldest = -1;
+    b->newest = -1;
+    b->seq = 0;
+    memset(&b->stats, 0, sizeof(b->stats));
+    pthread_mutex_init_or_die(&b->lock, NULL);
+    pthread_cond_init_or_die(&b->not_full, NULL);
+    pthread_cond_init_or_die(&b->not_empty, NULL);
+}
+
+//
+// Min-heap on (key, seq); ties go to the earlier arrival
+//
+static int slot_less(buffer_t *b, int i, int j) {
+    buffer_slot_t *x = &b->slots[b->heap[i]], *y = &b->slots[b->heap[j]];
+    return x->key < y->key || (x->key == y->key && x->seq < y->seq);
+}
+
+static void heap_swap(buffer_t *b, int i, int j) {
+    int tmp = b->heap[i];
+    b->heap[i] = b->heap[j];
+    b->heap[j] = tmp;
+    b->slots[b->heap[i]].heap_index = i;
+    b->slots[b->heap[j]].heap_index = j;
+}
+
+static void heap_up(buffer_t *b, int i) {
+    while (i > 0 && slot_less(b, i, (i - 1) / 2)) {
+	heap_swap(b, i, (i - 1) / 2);
+	i = (i - 1) / 2;
+    }
+}
+
+static void heap_down(buffer_t *b, int i) {
+    while (1) {
+	int l = 2 * i + 1, r = l + 1, m = i;
+	if (l < b->count && slot_less(b, l, m))
+	    m = l;
+	if (r < b->count && slot_less(b, r, m))
+	    m = r;
+	if (m == i)
+	    return;
+	heap_swap(b, i, m);
+	i = m;
+    }
+}
+
+// Caller has already decremented b->count
+static void heap_remove(buffer_t *b, int i) {
+    b->slots[b->heap[i]].heap_index = -1;
+    if (i == b->count)
+	return;
+    b->heap[i] = b->heap[b->count];
+    b->slots[b->heap[i]].heap_index = i;
+    heap_up(b, i);
+    heap_down(b, i);
+}
+
+static void record_wait(buffer_t *b, double wait) {
+    buffer_stats_t *s = &b->stats;
+    s->wait_total += wait;
+    if (wait > s->wait_max)
+	s->wait_max = wait;
+    unsigned long usecs = (unsigned long) (wait * 1e6);
+    int bucket = 0;
+    while (usecs > 0 && bucket < BUFFER_WAIT_BUCKETS - 1) {
+	usecs >>= 1;
+	bucket++;
+    }
+    s->wait_hist[bucket]++;
+}
+
+//
+// Called by the master thread; blocks while every slot is taken
+//
+void buffer_put(buffer_t *b, int fd, long key) {
+    pthread_mutex_lock_or_die(&b->lock);
+    while (b->count == b->size)
+	pthread_cond_wait_or_die(&b->not_full, &b->lock);
+
+    int i = b->free_head;
+    buffer_slot_t *s = &b->slots[i];
+    b->free_head = s->next;
+    s->fd = fd;
+    s->key = key;
+    s->seq = b->seq++;
+    s->dispatch = b->stats.dispatched;
+    s->enqueued = now_seconds();
+
+    // append to arrival order
+    s->prev = b->newest;
+    s->next = -1;
+    if (b->newest >= 0)
+	b->slots[b->newest].next = i;
+    else
+	b->oldest = i;
+    b->newest = i;
+
+    if (b->policy != SCHED_FIFO_POLICY) {
+	b->heap[b->count] = i;
+	s->heap_index = b->count;
+	heap_up(b, b->count);
+    } else {
+	s->heap_index = -1;
+    }
+    b->count++;
+
+    pthread_cond_signal_or_die(&b->not_empty);
+    pthread_mutex_unlock_or_die(&b->lock);
+}
+
+//
+// Called by the worker threads; blocks until a connection is available
+//
+int buffer_get(buffer_t *b) {
+    pthread_mutex_lock_or_die(&b->lock);
+    while (b->count == 0)
+	pthread_cond_wait_or_die(&b->not_empty, &b->lock);
+
+    // FIFO (or an aged request) takes the oldest; otherwise the heap top
+    int i = b->oldest;
+    if (b->policy != SCHED_FIFO_POLICY) {
+	if (b->stats.dispatched - b->slots[i].dispatch >= BUFFER_AGE_MAX)
+	    b->stats.aged++;
+	else
+	    i = b->heap[0];
+    }
+
+    buffer_slot_t *s = &b->slots[i];
+    b->count--;
+    if (s->heap_index >= 0)
+	heap_remove(b, s->heap_index);
+
+    // unlink from arrival order, return slot to free list
+    if (s->prev >= 0)
+	b->slots[s->prev].next = s->next;
+    else
+	b->oldest = s->next;
+    if (s->next >= 0)
+	b->slots[s->next].prev = s->prev;
+    else
+	b->newest = s->prev;
+    s->next = b->free_head;
+    b->free_head = i;
+
+    int fd = s->fd;
+    b->stats.dispatched++;
+    double wait = now_seconds() - s->enqueued;
+    record_wait(b, wait);
+
+    pthread_cond_signal_or_die(&b->not_full);
+    pthread_mutex_unlock_or_die(&b->lock);
+    stats_record(STATS_QUEUE_WAIT, (unsigned long) (wait * 1e6));
+    return fd;
+}
+
+void buffer_get_stats(buffer_t *b, buffer_stats_t *stats) {
+    pthread_mutex_lock_or_die(&b->lock);
+    *stats = b->stats;
+    pthread_mutex_unlock_or_die(&b->lock);
+}
+
+// Upper bound (usecs) of the histogram bucket holding the given fraction
+static unsigned long wait_percentile(buffer_stats_t *s, double fraction) {
+    unsigned long target = (unsigned long) (fraction * s->dispatched + 0.5), seen = 0;
+    for (int i = 0; i < BUFFER_WAIT_BUCKETS; i++) {
+	seen += s->wait_hist[i];
+	if (seen >= target && seen > 0)
+	    return 1UL << i;
+    }
+    return 0;
+}
+
+void buffer_print_stats(buffer_t *b, FILE *fp) {
+    buffer_stats_t s;
+    buffer_get_stats(b, &s);
+    fprintf(fp, "policy:%s dispatched:%lu aged:%lu wait_avg_us:%.0f wait_max_us:%.0f "
+	    "wait_p50_us:<%lu wait_p99_us:<%lu\n",
+	    buffer_policy_name(b->policy), s.dispatched, s.aged,
+	    s.dispatched ? s.wait_total * 1e6 / s.dispatched : 0.0,
+	    s.wait_max * 1e6, wait_percentile(&s, 0.50), wait_percentile(&s, 0.99));
+}
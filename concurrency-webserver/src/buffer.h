@@ -0,0 +1,69 @@
+#ifndef __BUFFER_H__
+#define __BUFFER_H__
+
+#include <pthread.h>
+#include <stdio.h>
+
+//
+// Scheduling policies for choosing which buffered connection is handled next
+//
+#define SCHED_FIFO_POLICY (0)  // oldest request first
+#define SCHED_SFF_POLICY  (1)  // smallest file (st_size) first
+#define SCHED_SFNF_POLICY (2)  // smallest file name first
+
+// Under SFF/SFNF, a request that has been passed over this many times
+// is served next regardless of its key, so large files cannot starve
+#define BUFFER_AGE_MAX (16)
+
+// Queue wait histogram: bucket i counts waits in [2^(i-1), 2^i) usecs
+#define BUFFER_WAIT_BUCKETS (32)
+
+typedef struct {
+    int fd;
+    long key;                // policy key; smaller is served first
+    unsigned long seq;       // arrival order
+    unsigned long dispatch;  // value of buffer's dispatched count on arrival
+    double enqueued;         // arrival time, in seconds
+    int prev, next;          // arrival-order list links (-1 terminates)
+    int heap_index;          // position in heap, -1 if not in heap
+} buffer_slot_t;
+
+typedef struct {
+    unsigned long dispatched;    // requests handed to workers
+    unsigned long aged;          // requests promoted by BUFFER_AGE_MAX
+    double wait_total;           // summed queue wait, in seconds
+    double wait_max;             // longest queue wait, in seconds
+    unsigned long wait_hist[BUFFER_WAIT_BUCKETS];
+} buffer_stats_t;
+
+//
+// Fixed-size set of accepted connection descriptors, shared between
+// the master (producer) thread and the worker (consumer) threads.
+// Slots are threaded on an arrival-order list; for SFF/SFNF they are
+// also kept in a binary min-heap on key.
+//
+typedef struct {
+    int policy;
+    buffer_slot_t *slots;
+    int *heap;            // slot indices
+    int size;             // number of slots
+    int count;            // number of slots currently filled
+    int free_head;        // free slot list, linked through 'next'
+    int oldest, newest;   // arrival-order list ends
+    unsigned long seq;
+    buffer_stats_t stats;
+    pthread_mutex_t lock;
+    pthread_cond_t not_full;
+    pthread_cond_t not_empty;
+} buffer_t;
+
+void buffer_init(buffer_t *b, int size, int policy);
+void buffer_put(buffer_t *b, int fd, long key);
+int buffer_get(buffer_t *b);
+void buffer_get_stats(buffer_t *b, buffer_stats_t *stats);
+void buffer_print_stats(buffer_t *b, FILE *fp);
+
+int buffer_parse_policy(const char *name);
+const char *buffer_policy_name(int policy);
+
+#endif // __BUFFER_H__
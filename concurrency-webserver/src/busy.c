@@ -0,0 +1,35 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+//
+// A CGI program that keeps the CPU busy for as many milliseconds as its
+// argument asks (busy.cgi?25), for benchmarks that need requests with
+// a known, precise service time. Unlike spin.cgi it neither sleeps nor
+// rounds to whole seconds.
+//
+
+double get_seconds() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double) t.tv_sec + (double) t.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    char *buf = getenv("QUERY_STRING");
+    double busy_for = (buf != NULL) ? atof(buf) / 1000.0 : 0.0;
+
+    double t1 = get_seconds(), t2;
+    volatile unsigned long work = 0;
+    while ((t2 = get_seconds()) - t1 < busy_for)
+	work++;
+
+    char content[256];
+    snprintf(content, sizeof(content), "<p>Busy for %.3f ms</p>\r\n", (t2 - t1) * 1e3);
+    printf("Content-length: %lu\r\n", strlen(content));
+    printf("Content-type: text/html\r\n\r\n");
+    printf("%s", content);
+    fflush(stdout);
+    exit(0);
+}
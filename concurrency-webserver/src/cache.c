@@ -0,0 +1,162 @@
+#include "io_helper.h"
+#include "cache.h"
+
+#define CACHE_BUCKETS (4096)
+
+int cache_enabled = 0;
+
+static cache_entry_t *buckets[CACHE_BUCKETS];
+static cache_entry_t *lru_head, *lru_tail;
+static cache_stats_t stats;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void cache_init(size_t capacity) {
+    stats.capacity = capacity;
+    cache_enabled = 1;
+}
+
+//
+// Only files that are small relative to the budget are worth caching;
+// one large file would otherwise flush out many hot small ones
+//
+int cache_admits(off_t size) {
+    return cache_enabled && size <= stats.capacity / 8;
+}
+
+static unsigned int hash(char *key) {
+    unsigned int h = 2166136261u; // FNV-1a
+    for (; *key; key++)
+	h = (h ^ (unsigned char) *key) * 16777619u;
+    return h % CACHE_BUCKETS;
+}
+
+static void entry_free(cache_entry_t *e) {
+    free(e->key);
+    free(e->head[0]);
+    free(e->head[1]);
+    free(e->body);
+    free(e);
+}
+
+static void lru_unlink(cache_entry_t *e) {
+    if (e->prev)
+	e->prev->next = e->next;
+    else
+	lru_head = e->next;
+    if (e->next)
+	e->next->prev = e->prev;
+    else
+	lru_tail = e->prev;
+}
+
+static void lru_push(cache_entry_t *e) {
+    e->prev = NULL;
+    e->next = lru_head;
+    if (lru_head)
+	lru_head->prev = e;
+    else
+	lru_tail = e;
+    lru_head = e;
+}
+
+// Takes e out of the table; it is freed once the last reply lets go
+static void remove_locked(cache_entry_t *e) {
+    cache_entry_t **pp = &buckets[hash(e->key)];
+    while (*pp != e)
+	pp = &(*pp)->chain;
+    *pp = e->chain;
+    lru_unlink(e);
+    stats.bytes -= e->bytes;
+    stats.entries--;
+    if (--e->refs == 0)
+	entry_free(e);
+}
+
+//
+// Returns the entry for filename, pinned for the caller, if one exists
+// and the file still matches sbuf; NULL otherwise
+//
+cache_entry_t *cache_lookup(char *filename, struct stat *sbuf) {
+    pthread_mutex_lock_or_die(&cache_lock);
+    cache_entry_t *e = buckets[hash(filename)];
+    while (e && strcmp(e->key, filename))
+	e = e->chain;
+    if (e && (e->size != sbuf->st_size || e->ino != sbuf->st_ino ||
+	      e->mtime.tv_sec != sbuf->st_mtim.tv_sec || e->mtime.tv_nsec != sbuf->st_mtim.tv_nsec)) {
+	stats.stale++;
+	remove_locked(e);
+	e = NULL;
+    }
+    if (e) {
+	stats.hits++;
+	e->refs++;
+	lru_unlink(e);
+	lru_push(e);
+    } else {
+	stats.misses++;
+    }
+    pthread_mutex_unlock_or_die(&cache_lock);
+    return e;
+}
+
+//
+// Adds a reply to the cache, taking ownership of the buffers, evicting
+// older entries as needed. Returns it pinned for the caller.
+//
+cache_entry_t *cache_insert(char *filename, struct stat *sbuf, char *head[2], size_t head_len[2],
+			    char *body, size_t body_len) {
+    cache_entry_t *e = malloc_or_die(sizeof(cache_entry_t));
+    e->key = strdup(filename);
+    for (int i = 0; i < 2; i++) {
+	e->head[i] = head[i];
+	e->head_len[i] = head_len[i];
+    }
+    e->body = body;
+    e->body_len = body_len;
+    e->bytes = sizeof(*e) + strlen(filename) + head_len[0] + head_len[1] + body_len;
+    e->mtime = sbuf->st_mtim;
+    e->size = sbuf->st_size;
+    e->ino = sbuf->st_ino;
+    e->refs = 2;
+
+    pthread_mutex_lock_or_die(&cache_lock);
+    // another thread may have raced us here with the same file
+    unsigned int b = hash(filename);
+    for (cache_entry_t *old = buckets[b]; old; old = old->chain)
+	if (strcmp(old->key, filename) == 0) {
+	    remove_locked(old);
+	    break;
+	}
+    while (lru_tail && stats.bytes + e->bytes > stats.capacity) {
+	stats.evictions++;
+	remove_locked(lru_tail);
+    }
+    e->chain = buckets[b];
+    buckets[b] = e;
+    lru_push(e);
+    stats.bytes += e->bytes;
+    stats.entries++;
+    pthread_mutex_unlock_or_die(&cache_lock);
+    return e;
+}
+
+void cache_release(cache_entry_t *e) {
+    pthread_mutex_lock_or_die(&cache_lock);
+    int last = (--e->refs == 0);
+    pthread_mutex_unlock_or_die(&cache_lock);
+    if (last)
+	entry_free(e);
+}
+
+void cache_get_stats(cache_stats_t *s) {
+    pthread_mutex_lock_or_die(&cache_lock);
+    *s = stats;
+    pthread_mutex_unlock_or_die(&cache_lock);
+}
+
+void cache_print_stats(FILE *fp) {
+    cache_stats_t s;
+    cache_get_stats(&s);
+    fprintf(fp, "cache hits:%lu misses:%lu stale:%lu evictions:%lu entries:%lu bytes:%zu/%zu\n",
+	    s.hits, s.misses, s.stale, s.evictions, s.entries, s.bytes, s.capacity);
+}
@@ -0,0 +1,51 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+//
+// In-memory cache of static replies, keyed by resolved filename. An entry
+// holds the whole reply pre-rendered: one header per keep-alive setting
+// and the file contents. Entries are revalidated against the stat() the
+// request path already does, and evicted least recently used first once
+// the byte budget is used up.
+//
+typedef struct cache_entry {
+    char *key;
+    char *head[2];               // header, indexed by keep_alive
+    size_t head_len[2];
+    char *body;
+    size_t body_len;
+    size_t bytes;                // charged against the budget
+    struct timespec mtime;       // revalidation: file unchanged if these match
+    off_t size;
+    ino_t ino;
+    int refs;                    // one for the table, one per reply in flight
+    struct cache_entry *chain;   // hash bucket
+    struct cache_entry *prev, *next; // LRU list, most recently used first
+} cache_entry_t;
+
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long stale;         // entries dropped because the file changed
+    unsigned long evictions;
+    size_t bytes;
+    size_t capacity;
+    unsigned long entries;
+} cache_stats_t;
+
+extern int cache_enabled;
+
+void cache_init(size_t capacity);
+int cache_admits(off_t size);
+cache_entry_t *cache_lookup(char *filename, struct stat *sbuf);
+cache_entry_t *cache_insert(char *filename, struct stat *sbuf, char *head[2], size_t head_len[2],
+			    char *body, size_t body_len);
+void cache_release(cache_entry_t *e);
+void cache_get_stats(cache_stats_t *stats);
+void cache_print_stats(FILE *fp);
+
+#endif // __CACHE_H__
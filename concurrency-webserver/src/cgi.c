@@ -0,0 +1,267 @@
+#include "io_helper.h"
+#include "cgi.h"
+
+// a program whose workers die this many times in a row without
+// finishing a request does not speak the protocol; fork it instead
+#define CGI_MAX_FAILURES (3)
+
+#define CGI_BATCH (16)
+
+#define WORKER_STARTING (0)  // waiting for its READY frame
+#define WORKER_IDLE     (1)
+#define WORKER_BUSY     (2)
+#define WORKER_DEAD     (3)
+
+int cgi_workers = 0; // per program; 0 means fork per request
+
+typedef struct cgi_job {
+    int fd;
+    char *query;
+    struct cgi_job *next;
+} cgi_job_t;
+
+struct cgi_program;
+
+typedef struct {
+    pid_t pid;
+    int ctl;                     // server end of the control socket
+    int state;
+    struct cgi_program *prog;
+} cgi_worker_t;
+
+typedef struct cgi_program {
+    char *filename;
+    cgi_worker_t *workers;
+    int failures;                // consecutive worker deaths
+    int broken;
+    cgi_job_t *pending, *pending_tail;
+    struct cgi_program *next;
+} cgi_program_t;
+
+static pthread_mutex_t cgi_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cgi_started = PTHREAD_COND_INITIALIZER;
+static cgi_program_t *programs;
+static int monitor_epfd;
+
+static void worker_start(cgi_worker_t *w) {
+    int sv[2];
+    w->state = WORKER_DEAD;
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+	perror("socketpair");
+	return;
+    }
+    if ((w->pid = fork_or_warn()) < 0) {
+	close(sv[0]);
+	close(sv[1]);
+	return;
+    }
+    w->ctl = sv[0];
+    w->state = WORKER_STARTING;
+    if (w->pid == 0) {
+	char *argv[] = { NULL };
+	extern char **environ;
+	dup2_or_die(sv[1], CGI_CONTROL_FD);
+	// stdout only means something while a request is being answered
+	int devnull = open_or_die("/dev/null", O_WRONLY, 0);
+	dup2_or_die(devnull, STDOUT_FILENO);
+	// don't let client sockets of other requests leak into a process
+	// that lives on; they would never see EOF
+	close_range(3, ~0U, 0);
+	setenv_or_die(CGI_PERSISTENT_ENV, "1", 1);
+	execve_or_die(w->prog->filename, argv, environ);
+    }
+    close_or_warn(sv[1]);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = w };
+    epoll_ctl_or_die(monitor_epfd, EPOLL_CTL_ADD, w->ctl, &ev);
+}
+
+// Hands a request to an idle worker, which then owns the reply. Returns
+// -1 if it could not be sent; the worker stays idle, and the caller
+// still has the client (a worker that has died shows up as EOF on ctl
+// in the monitor)
+static int worker_send(cgi_worker_t *w, int fd, char *query) {
+    cgi_frame_t frame = { .type = CGI_FRAME_REQUEST, .len = strlen(query) };
+    struct iovec iov[2] = {
+	{ .iov_base = &frame, .iov_len = sizeof(frame) },
+	{ .iov_base = query, .iov_len = frame.len },
+    };
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg = {
+	.msg_iov = iov, .msg_iovlen = 2,
+	.msg_control = control, .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    if (sendmsg(w->ctl, &msg, MSG_NOSIGNAL) < 0) {
+	perror("sendmsg");
+	return -1;
+    }
+    w->state = WORKER_BUSY;
+    return 0;
+}
+
+static void job_free(cgi_job_t *job) {
+    close_or_warn(job->fd);
+    free(job->query);
+    free(job);
+}
+
+// Gives a worker that just became idle the oldest queued request. If
+// that cannot be handed over, its client is dropped rather than retried.
+static void worker_next_job(cgi_worker_t *w) {
+    cgi_program_t *p = w->prog;
+    cgi_job_t *job = p->pending;
+    w->state = WORKER_IDLE;
+    if (job == NULL)
+	return;
+    p->pending = job->next;
+    if (p->pending == NULL)
+	p->pending_tail = NULL;
+    worker_send(w, job->fd, job->query); // it has its own copy of fd
+    job_free(job);
+}
+
+static void worker_died(cgi_worker_t *w) {
+    cgi_program_t *p = w->prog;
+    close_or_die(w->ctl); // also drops it from the epoll set
+    waitpid(w->pid, NULL, 0);
+    w->state = WORKER_DEAD;
+    if (p->broken)
+	return;
+    if (++p->failures < CGI_MAX_FAILURES) {
+	worker_start(w);
+	return;
+    }
+    fprintf(stderr, "cgi: %s does not run as a persistent worker; forking it per request\n",
+	    p->filename);
+    p->broken = 1;
+    for (int i = 0; i < cgi_workers; i++)
+	if (p->workers[i].state != WORKER_DEAD) {
+	    kill(p->workers[i].pid, SIGTERM); // reaped when its ctl hits EOF
+	}
+    // nobody will serve what is queued; drop those clients
+    while (p->pending) {
+	cgi_job_t *job = p->pending;
+	p->pending = job->next;
+	job_free(job);
+    }
+    p->pending_tail = NULL;
+}
+
+//
+// Collects READY and DONE frames and worker deaths. A worker that becomes
+// idle takes the next queued request, if any; a dead one is reaped (by
+// pid) and replaced.
+//
+static void *cgi_monitor(void *arg) {
+    struct epoll_event events[CGI_BATCH];
+    while (1) {
+	int n = epoll_wait(monitor_epfd, events, CGI_BATCH, -1);
+	for (int i = 0; i < n; i++) {
+	    cgi_worker_t *w = events[i].data.ptr;
+	    cgi_frame_t frame;
+	    ssize_t rc = read(w->ctl, &frame, sizeof(frame));
+
+	    pthread_mutex_lock_or_die(&cgi_lock);
+	    if (rc == sizeof(frame) && frame.type == CGI_FRAME_READY && w->state == WORKER_STARTING) {
+		worker_next_job(w);
+	    } else if (rc == sizeof(frame) && frame.type == CGI_FRAME_DONE && w->state == WORKER_BUSY) {
+		w->prog->failures = 0;
+		worker_next_job(w);
+	    } else {
+		worker_died(w);
+	    }
+	    pthread_cond_broadcast(&cgi_started);
+	    pthread_mutex_unlock_or_die(&cgi_lock);
+	}
+    }
+    return NULL;
+}
+
+void cgi_init(int workers) {
+    cgi_workers = workers;
+    monitor_epfd = epoll_create1_or_die(EPOLL_CLOEXEC);
+    pthread_t tid;
+    pthread_create_or_die(&tid, NULL, cgi_monitor, NULL);
+}
+
+static int program_starting(cgi_program_t *p) {
+    for (int i = 0; i < cgi_workers; i++)
+	if (p->workers[i].state == WORKER_STARTING)
+	    return 1;
+    return 0;
+}
+
+//
+// Finds the pool for filename, starting one the first time. That waits
+// (once) until the new workers are ready or the program turns out not
+// to speak the protocol, so no request is ever sent to the latter.
+//
+static cgi_program_t *program_get(char *filename) {
+    cgi_program_t *p;
+    for (p = programs; p; p = p->next)
+	if (strcmp(p->filename, filename) == 0)
+	    break;
+    if (p == NULL) {
+	p = malloc_or_die(sizeof(cgi_program_t));
+	p->filename = strdup(filename);
+	p->workers = malloc_or_die(sizeof(cgi_worker_t) * cgi_workers);
+	p->failures = 0;
+	p->broken = 0;
+	p->pending = p->pending_tail = NULL;
+	for (int i = 0; i < cgi_workers; i++) {
+	    p->workers[i].prog = p;
+	    worker_start(&p->workers[i]);
+	}
+	p->next = programs;
+	programs = p;
+    }
+    while (!p->broken && program_starting(p))
+	pthread_cond_wait_or_die(&cgi_started, &cgi_lock);
+    return p;
+}
+
+//
+// Passes the request on fd to a persistent worker for filename, or
+// queues it until one is free; never waits for the CGI itself. fd stays
+// the caller's to close. Returns -1 if the program cannot be run this
+// way, or the request could not be passed on or queued, in which case
+// the caller should fork it as usual.
+//
+int cgi_dispatch(int fd, char *filename, char *cgiargs) {
+    pthread_mutex_lock_or_die(&cgi_lock);
+    cgi_program_t *p = program_get(filename);
+    if (p->broken) {
+	pthread_mutex_unlock_or_die(&cgi_lock);
+	return -1;
+    }
+    for (int i = 0; i < cgi_workers; i++) {
+	cgi_worker_t *w = &p->workers[i];
+	if (w->state == WORKER_IDLE) {
+	    int rc = worker_send(w, fd, cgiargs);
+	    pthread_mutex_unlock_or_die(&cgi_lock);
+	    return rc;
+	}
+    }
+    int copy = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (copy < 0) {
+	perror("fcntl");
+	pthread_mutex_unlock_or_die(&cgi_lock);
+	return -1;
+    }
+    cgi_job_t *job = malloc_or_die(sizeof(cgi_job_t));
+    job->fd = copy;
+    job->query = strdup(cgiargs);
+    job->next = NULL;
+    if (p->pending_tail)
+	p->pending_tail->next = job;
+    else
+	p->pending = job;
+    p->pending_tail = job;
+    pthread_mutex_unlock_or_die(&cgi_lock);
+    return 0;
+}
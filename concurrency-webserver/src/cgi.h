@@ -0,0 +1,39 @@
+#ifndef __CGI_H__
+#define __CGI_H__
+
+#include <stdint.h>
+
+//
+// Persistent CGI workers. Instead of a fork+execve per dynamic request,
+// each CGI program gets a small pool of long-lived processes, started
+// with CGI_PERSISTENT set in the environment and a control socket on
+// stdin (as in FastCGI). Over it the server and worker exchange frames:
+//
+//   worker -> server: CGI_FRAME_READY, no payload, once at startup
+//   server -> worker: CGI_FRAME_REQUEST, payload is the QUERY_STRING,
+//                     with the client socket attached (SCM_RIGHTS)
+//   worker -> server: CGI_FRAME_DONE, no payload, once the reply has
+//                     been written to that socket and it is closed
+//
+// The worker writes its output straight to the client, exactly as a
+// forked CGI program would, so the serving thread never relays it.
+// See spin.c for a reference worker.
+//
+#define CGI_PERSISTENT_ENV "CGI_PERSISTENT"
+#define CGI_CONTROL_FD     (0)
+
+#define CGI_FRAME_READY   (1)
+#define CGI_FRAME_REQUEST (2)
+#define CGI_FRAME_DONE    (3)
+
+typedef struct {
+    uint32_t type;
+    uint32_t len;   // payload bytes following the frame header
+} cgi_frame_t;
+
+extern int cgi_workers;
+
+void cgi_init(int workers);
+int cgi_dispatch(int fd, char *filename, char *cgiargs);
+
+#endif // __CGI_H__
@@ -0,0 +1,251 @@
+#include "io_helper.h"
+#include "request.h"
+#include "event.h"
+#include "stats.h"
+
+#define EVENT_BATCH (64)
+
+#define CONN_READING (0)
+#define CONN_WRITING (1)
+
+//
+// Per-connection state. Requests are collected in rio until the blank
+// line ending the headers shows up; each reply in resp is then written
+// out as the socket drains, after which the next (possibly already
+// pipelined) request is taken up.
+//
+typedef struct conn {
+    int fd;
+    int state;
+    int served;                  // requests answered so far
+    time_t last_active;
+    struct conn *prev, *next;    // loop's activity list, least recent first
+    request_t req;
+    rio_t rio;
+    response_t resp;
+} conn_t;
+
+//
+// One per event loop thread; connections belong to the loop that
+// accepted them and are only touched by it
+//
+typedef struct {
+    int epfd;
+    int listen_fd;
+    int spare_fd;                // given up to shed a connection on EMFILE
+    unsigned long accept_resume; // stats_now() to watch listen_fd again at, or 0
+    conn_t *oldest, *newest;
+} loop_t;
+
+static void conn_unlink(loop_t *loop, conn_t *c) {
+    if (c->prev)
+	c->prev->next = c->next;
+    else
+	loop->oldest = c->next;
+    if (c->next)
+	c->next->prev = c->prev;
+    else
+	loop->newest = c->prev;
+}
+
+// Puts c at the recent end of the activity list
+static void conn_append(loop_t *loop, conn_t *c) {
+    c->last_active = time(NULL);
+    c->prev = loop->newest;
+    c->next = NULL;
+    if (loop->newest)
+	loop->newest->next = c;
+    else
+	loop->oldest = c;
+    loop->newest = c;
+}
+
+static void conn_touch(loop_t *loop, conn_t *c) {
+    conn_unlink(loop, c);
+    conn_append(loop, c);
+}
+
+static void conn_close(loop_t *loop, conn_t *c) {
+    conn_unlink(loop, c);
+    // close() alone leaves it in the epoll set while a CGI child still
+    // holds the socket, and events would then arrive for a freed conn
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    response_free(&c->resp);
+    free(c);
+    request_release();
+}
+
+//
+// Serves every request that can be completed without blocking. Returns
+// 0 when the connection is finished (and freed), 1 if it is waiting for
+// the socket to become readable or writable.
+//
+static int conn_run(loop_t *loop, conn_t *c) {
+    while (1) {
+	if (c->state == CONN_WRITING) {
+	    int rc = response_write(c->fd, &c->resp);
+	    if (rc == 0)
+		return 1; // wait for EPOLLOUT
+	    if (rc < 0 || !c->resp.keep_alive) {
+		conn_close(loop, c);
+		return 0;
+	    }
+	    response_free(&c->resp);
+	    c->state = CONN_READING;
+	}
+
+	// skip the previous request's body, then wait for a whole request
+	int rc = rio_discard(&c->rio, &c->req.content_length);
+	if (rc > 0)
+	    rc = rio_fill_headers(&c->rio);
+	if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	    return 1; // wait for EPOLLIN
+	if (rc < 0 && errno == ENOBUFS) {
+	    c->req.keep_alive = 0;
+	    request_error(&c->resp, "request", "400", "Bad Request", "request header too large");
+	    c->state = CONN_WRITING;
+	    continue;
+	}
+	if (rc < 0 && errno == ETIMEDOUT) {
+	    c->req.keep_alive = 0;
+	    request_error(&c->resp, "request", "408", "Request Timeout", "request took too long to arrive");
+	    c->state = CONN_WRITING;
+	    continue;
+	}
+	if (rc <= 0) {
+	    conn_close(loop, c);
+	    return 0;
+	}
+
+	request_read_headers(&c->rio, &c->req);
+	if (++c->served >= request_keepalive_max)
+	    c->req.keep_alive = 0;
+	if (request_prepare(&c->req, &c->resp) == REQUEST_DYNAMIC) {
+	    // Hand the socket to the CGI program (forked or persistent), which
+	    // writes to it until done; SIGCHLD is ignored, so the kernel
+	    // reaps forked ones for us
+	    int flags = fcntl(c->fd, F_GETFL);
+	    fcntl(c->fd, F_SETFL, flags & ~O_NONBLOCK);
+	    request_start_dynamic(c->fd, c->req.filename, c->req.cgiargs);
+	    conn_close(loop, c);
+	    return 0;
+	}
+	c->state = CONN_WRITING;
+    }
+}
+
+static void conn_event(loop_t *loop, conn_t *c, uint32_t events) {
+    if (events & EPOLLERR) {
+	conn_close(loop, c);
+	return;
+    }
+    conn_touch(loop, c);
+    if ((c->state == CONN_READING && (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))) ||
+	(c->state == CONN_WRITING && (events & EPOLLOUT)))
+	conn_run(loop, c);
+}
+
+// Closes connections that have made no progress for request_idle_secs
+static void expire_idle(loop_t *loop) {
+    time_t now = time(NULL);
+    while (loop->oldest && now - loop->oldest->last_active >= request_idle_secs)
+	conn_close(loop, loop->oldest);
+}
+
+// Watches the listener again, or stops watching it while out of descriptors
+static void listen_arm(loop_t *loop, int on) {
+    // EPOLLEXCLUSIVE: a new connection wakes one loop, not all of them
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = NULL };
+    epoll_ctl_or_die(loop->epfd, on ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, loop->listen_fd, &ev);
+}
+
+static void accept_all(loop_t *loop) {
+    while (1) {
+	int fd = accept4(loop->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0) {
+	    if (errno == EINTR || errno == ECONNABORTED)
+		continue;
+	    if (errno == EMFILE || errno == ENFILE) {
+		if (request_shed_overflow(loop->listen_fd, &loop->spare_fd) == 0)
+		    continue;
+		// the listener stays readable; ignore it for a while instead
+		listen_arm(loop, 0);
+		loop->accept_resume = stats_now() + REQUEST_SHED_BACKOFF_MS * 1000;
+		return;
+	    }
+	    if (errno != EAGAIN && errno != EWOULDBLOCK)
+		perror("accept4");
+	    return;
+	}
+	if (!request_admit()) {
+	    request_shed(fd);
+	    continue;
+	}
+	request_accepted(fd);
+	conn_t *c = malloc_or_die(sizeof(conn_t));
+	c->fd = fd;
+	c->state = CONN_READING;
+	c->served = 0;
+	conn_append(loop, c);
+	c->req.keep_alive = 0;
+	c->req.content_length = 0;
+	rio_init(&c->rio, fd);
+	c->rio.read_secs = request_read_secs;
+	response_init(&c->resp);
+
+	// edge-triggered: registering both directions once is enough
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = c };
+	if (epoll_ctl_or_warn(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+	    conn_close(loop, c);
+    }
+}
+
+static void *event_loop(void *arg) {
+    loop_t loop = { .listen_fd = *(int *) arg, .accept_resume = 0, .oldest = NULL, .newest = NULL };
+    loop.spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    struct epoll_event events[EVENT_BATCH];
+
+    loop.epfd = epoll_create1_or_die(EPOLL_CLOEXEC);
+    listen_arm(&loop, 1);
+
+    while (1) {
+	// wake at least once a second to close idle connections, and in
+	// time to take up accepting again after running out of descriptors
+	int n = epoll_wait(loop.epfd, events, EVENT_BATCH, loop.accept_resume ? REQUEST_SHED_BACKOFF_MS : 1000);
+	if (n < 0) {
+	    assert(errno == EINTR);
+	    continue;
+	}
+	for (int i = 0; i < n; i++) {
+	    if (events[i].data.ptr == NULL)
+		accept_all(&loop);
+	    else
+		conn_event(&loop, events[i].data.ptr, events[i].events);
+	}
+	expire_idle(&loop);
+	if (loop.accept_resume && stats_now() >= loop.accept_resume) {
+	    loop.accept_resume = 0;
+	    listen_arm(&loop, 1);
+	}
+    }
+    return NULL;
+}
+
+void event_run(int listen_fd, int threads) {
+    // the loops keep a pointer to it, and shards each call this
+    int *fd = malloc_or_die(sizeof(int));
+    *fd = listen_fd;
+
+    // nobody waits for CGI children in this engine
+    signal(SIGCHLD, SIG_IGN);
+
+    int flags = fcntl(listen_fd, F_GETFL);
+    fcntl(listen_fd, F_SETFL, flags | O_NONBLOCK);
+
+    for (int i = 1; i < threads; i++) {
+	pthread_t tid;
+	pthread_create_or_die(&tid, NULL, event_loop, fd);
+    }
+    event_loop(fd);
+}
@@ -0,0 +1,11 @@
+#ifndef __EVENT_H__
+#define __EVENT_H__
+
+//
+// Event-driven engine: each of 'threads' loops owns an epoll instance,
+// accepts from the shared listen_fd, and drives its non-blocking client
+// sockets through read-request / write-response. Does not return.
+//
+void event_run(int listen_fd, int threads);
+
+#endif // __EVENT_H__
@@ -0,0 +1,30 @@
+#include <zlib.h>
+#include "io_helper.h"
+#include "gzip.h"
+
+//
+// Compresses len bytes at data into a new gzip-format buffer, whose
+// size is stored in *out_len. Returns NULL if zlib fails.
+//
+char *gzip_compress(char *data, size_t len, size_t *out_len) {
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    // 15 window bits, plus 16 for a gzip header and trailer instead of zlib's
+    if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+	return NULL;
+
+    size_t room = deflateBound(&z, len);
+    char *out = malloc_or_die(room);
+    z.next_in = (Bytef *) data;
+    z.avail_in = len;
+    z.next_out = (Bytef *) out;
+    z.avail_out = room;
+    int rc = deflate(&z, Z_FINISH);
+    *out_len = z.total_out;
+    deflateEnd(&z);
+    if (rc != Z_STREAM_END) {
+	free(out);
+	return NULL;
+    }
+    return out;
+}
@@ -0,0 +1,11 @@
+#ifndef __GZIP_H__
+#define __GZIP_H__
+
+#include <stddef.h>
+
+// Files smaller than this are not worth compressing on the fly
+#define GZIP_MIN_SIZE (256)
+
+char *gzip_compress(char *data, size_t len, size_t *out_len);
+
+#endif // __GZIP_H__
@@ -0,0 +1,73 @@
+#include <string.h>
+#include "hist.h"
+
+void hist_init(hist_t *h) {
+    memset(h, 0, sizeof(*h));
+}
+
+static int hist_index(unsigned long v) {
+    if (v >= (1UL << HIST_MAX_BITS))
+	v = (1UL << HIST_MAX_BITS) - 1;
+    if (v < HIST_SUB)
+	return v;
+    // v lies in [2^msb, 2^(msb+1)); keep its top HIST_SUB_BITS + 1 bits
+    int shift = (63 - __builtin_clzl(v)) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (int) ((v >> shift) - HIST_SUB);
+}
+
+// Largest value that lands in bucket i
+static unsigned long hist_value(int i) {
+    if (i < HIST_SUB)
+	return i;
+    int shift = i / HIST_SUB - 1;
+    unsigned long mantissa = i % HIST_SUB + HIST_SUB;
+    return ((mantissa + 1) << shift) - 1;
+}
+
+#define HIST_STORE(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+#define HIST_LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+void hist_record(hist_t *h, unsigned long value) {
+    int i = hist_index(value);
+    HIST_STORE(h->counts[i], h->counts[i] + 1);
+    HIST_STORE(h->total, h->total + 1);
+    HIST_STORE(h->sum, h->sum + value);
+    if (value > h->max)
+	HIST_STORE(h->max, value);
+}
+
+void hist_merge(hist_t *dst, hist_t *src) {
+    unsigned long total = 0, max = HIST_LOAD(src->max);
+    for (int i = 0; i < HIST_SIZE; i++) {
+	unsigned long n = HIST_LOAD(src->counts[i]);
+	dst->counts[i] += n;
+	total += n;
+    }
+    // count what was seen, so percentiles add up even mid-update
+    dst->total += total;
+    dst->sum += HIST_LOAD(src->sum);
+    if (max > dst->max)
+	dst->max = max;
+}
+
+//
+// Value at or below which the given percentage (0-100) of recorded
+// values fall, rounded up to its bucket's upper bound
+//
+unsigned long hist_percentile(hist_t *h, double percentile) {
+    if (h->total == 0)
+	return 0;
+    unsigned long target = (unsigned long) (percentile / 100.0 * h->total + 0.5), seen = 0;
+    if (target == 0)
+	target = 1;
+    for (int i = 0; i < HIST_SIZE; i++) {
+	seen += h->counts[i];
+	if (seen >= target)
+	    return hist_value(i) < h->max ? hist_value(i) : h->max;
+    }
+    return h->max;
+}
+
+double hist_mean(hist_t *h) {
+    return h->total ? (double) h->sum / h->total : 0.0;
+}
@@ -0,0 +1,35 @@
+#ifndef __HIST_H__
+#define __HIST_H__
+
+#include <stdio.h>
+
+//
+// Log-linear latency histogram in the style of HdrHistogram: values
+// below 2^HIST_SUB_BITS get a bucket each; above that, every power of
+// two is split into 2^HIST_SUB_BITS buckets, so any recorded value is
+// known to within about 3%. Values are unsigned integers (usually
+// microseconds) below 2^HIST_MAX_BITS; larger ones are clamped.
+//
+// A histogram has one writer, but hist_merge may read it from another
+// thread while it is being recorded into: fields are updated with
+// plain (relaxed) atomic stores so such a reader never sees them torn.
+//
+#define HIST_SUB_BITS (5)
+#define HIST_MAX_BITS (40)
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_SIZE     ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct {
+    unsigned long counts[HIST_SIZE];
+    unsigned long total;
+    unsigned long max;
+    unsigned long sum;
+} hist_t;
+
+void hist_init(hist_t *h);
+void hist_record(hist_t *h, unsigned long value);
+void hist_merge(hist_t *dst, hist_t *src);
+unsigned long hist_percentile(hist_t *h, double percentile);
+double hist_mean(hist_t *h);
+
+#endif // __HIST_H__
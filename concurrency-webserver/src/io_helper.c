@@ -1,27 +1,140 @@
 #include "io_helper.h"
 
-ssize_t readline(int fd, void *buf, size_t maxlen) {
-    char c;
-    char *bufp = buf;
-    int n;
-    for (n = 0; n < maxlen - 1; n++) { // leave room at end for '\0'
-	int rc;
-        if ((rc = read_or_die(fd, &c, 1)) == 1) {
-            *bufp++ = c;
-            if (c == '\n')
-                break;
-        } else if (rc == 0) {
-            if (n == 1)
-                return 0; /* EOF, no data read */
-            else
-                break;    /* EOF, some data was read */
-        } else
-            return -1;    /* error */
+//
+// Buffered reader (after Bryant/O'Hallaron's rio): one large read() fills
+// the buffer and lines are handed out as slices of it, instead of one
+// read() system call per byte.
+//
+void rio_init(rio_t *rp, int fd) {
+    rp->fd = fd;
+    rp->start = 0;
+    rp->end = 0;
+    rp->read_secs = 0;
+    rp->deadline = 0;
+    rp->buf[0] = '\0';
+}
+
+//
+// Moves unread bytes to the front of the buffer (invalidating earlier
+// slices) and reads more after them. Returns bytes read, 0 on EOF, -1 on
+// error (including EAGAIN on a non-blocking fd, and ENOBUFS when the
+// buffer is full of unread data).
+//
+ssize_t rio_fill(rio_t *rp) {
+    ssize_t n;
+    if (rp->start > 0) {
+	memmove(rp->buf, rp->buf + rp->start, rp->end - rp->start);
+	rp->end -= rp->start;
+	rp->start = 0;
+    }
+    if (rp->end == RIO_BUFSIZE) {
+	errno = ENOBUFS;
+	return -1;
+    }
+    do {
+	n = read(rp->fd, rp->buf + rp->end, RIO_BUFSIZE - rp->end);
+    } while (n < 0 && errno == EINTR);
+    if (n > 0) {
+	rp->end += n;
+	rp->buf[rp->end] = '\0'; // so buffered data can be scanned as a string
     }
-    *bufp = '\0';
     return n;
 }
 
+//
+// Points *linep at the next line (including its '\n') and returns its
+// length; the slice stays valid until the next rio_fill. A line longer
+// than the buffer, or a last line without '\n', comes back as is.
+// Returns 0 on EOF, -1 on error.
+//
+ssize_t rio_readline(rio_t *rp, char **linep) {
+    while (1) {
+	char *line = rp->buf + rp->start;
+	size_t avail = rp->end - rp->start;
+	char *nl = memchr(line, '\n', avail);
+	if (nl || avail == RIO_BUFSIZE) {
+	    size_t len = nl ? nl - line + 1 : avail;
+	    rp->start += len;
+	    *linep = line;
+	    return len;
+	}
+	ssize_t n = rio_fill(rp);
+	if (n == 0) {
+	    // EOF: hand back whatever is left
+	    line = rp->buf + rp->start;
+	    avail = rp->end - rp->start;
+	    rp->start = rp->end;
+	    *linep = line;
+	    return avail;
+	}
+	if (n < 0)
+	    return -1;
+    }
+}
+
+//
+// Returns 1 if the unread data holds a complete header block: a line,
+// then an empty line ending in either "\r\n" or "\n"
+//
+static int rio_has_headers(rio_t *rp) {
+    char *p = rp->buf + rp->start, *end = rp->buf + rp->end;
+    while ((p = memchr(p, '\n', end - p)) != NULL) {
+	p++;
+	if (p < end && *p == '\n')
+	    return 1;
+	if (p + 1 < end && p[0] == '\r' && p[1] == '\n')
+	    return 1;
+    }
+    return 0;
+}
+
+//
+// Reads until a whole request (line plus headers) is buffered, so it can
+// then be taken apart with rio_readline without further reads or copies.
+// Returns 1 when it is, 0 on EOF first, -1 on error (EAGAIN on a
+// non-blocking fd: call again when readable; ENOBUFS: too large;
+// ETIMEDOUT: read_secs went by between its first byte and its last).
+// Waiting for a request to start is not timed here; that is idle time.
+//
+int rio_fill_headers(rio_t *rp) {
+    while (!rio_has_headers(rp)) {
+	if (rp->read_secs > 0 && rp->end > rp->start) {
+	    time_t now = time(NULL);
+	    if (rp->deadline == 0)
+		rp->deadline = now + rp->read_secs;
+	    else if (now >= rp->deadline) {
+		errno = ETIMEDOUT;
+		return -1;
+	    }
+	}
+	ssize_t n = rio_fill(rp);
+	if (n <= 0)
+	    return n;
+    }
+    rp->deadline = 0;
+    return 1;
+}
+
+//
+// Consumes the next *remaining bytes (e.g. a request body), counting
+// *remaining down as it goes so a non-blocking caller can resume.
+// Returns 1 once they are all gone, 0 on EOF, -1 on error.
+//
+int rio_discard(rio_t *rp, size_t *remaining) {
+    while (*remaining > 0) {
+	size_t avail = rp->end - rp->start;
+	if (avail == 0) {
+	    ssize_t n = rio_fill(rp);
+	    if (n <= 0)
+		return n;
+	    continue;
+	}
+	size_t k = avail < *remaining ? avail : *remaining;
+	rp->start += k;
+	*remaining -= k;
+    }
+    return 1;
+}
 
 int open_client_fd(char *hostname, int port) {
     int client_fd;
@@ -32,8 +145,10 @@ int open_client_fd(char *hostname, int port) {
         return -1; 
     
     // Fill in the server's IP address and port 
-    if ((hp = gethostbyname(hostname)) == NULL)
+    if ((hp = gethostbyname(hostname)) == NULL) {
+        close(client_fd);
         return -2; // check h_errno for cause of error 
+    }
     bzero((char *) &server_addr, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     bcopy((char *) hp->h_addr, 
@@ -41,12 +156,18 @@ int open_client_fd(char *hostname, int port) {
     server_addr.sin_port = htons(port);
     
     // Establish a connection with the server 
-    if (connect(client_fd, (sockaddr_t *) &server_addr, sizeof(server_addr)) < 0)
+    if (connect(client_fd, (sockaddr_t *) &server_addr, sizeof(server_addr)) < 0) {
+        close(client_fd);
         return -1;
+    }
     return client_fd;
 }
 
-int open_listen_fd(int port) {
+//
+// With reuseport set, several sockets (one per shard) can listen on the
+// same port, and the kernel spreads incoming connections across them
+//
+int open_listen_fd(int port, int reuseport, int backlog) {
     // Create a socket descriptor 
     int listen_fd;
     if ((listen_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
@@ -60,6 +181,10 @@ int open_listen_fd(int port) {
 	fprintf(stderr, "setsockopt() failed\n");
 	return -1;
     }
+    if (reuseport && setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, (const void *) &optval, sizeof(int)) < 0) {
+	fprintf(stderr, "setsockopt() failed\n");
+	return -1;
+    }
     
     // Listen_fd will be an endpoint for all requests to port on any IP address for this host
     struct sockaddr_in server_addr;
@@ -73,7 +198,7 @@ int open_listen_fd(int port) {
     }
     
     // Make it a listening socket ready to accept connection requests 
-    if (listen(listen_fd, 1024) < 0) {
+    if (listen(listen_fd, backlog) < 0) {
 	fprintf(stderr, "listen() failed\n");
 	return -1;
     }
@@ -6,20 +6,30 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/epoll.h>
 #include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/time.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/sysinfo.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 typedef struct sockaddr sockaddr_t;
@@ -34,6 +44,8 @@ typedef struct sockaddr sockaddr_t;
     assert(execve(filename, argv, envp) == 0); 
 #define wait_or_die(status) \
     ({ pid_t pid = wait(status); assert(pid >= 0); pid; })
+#define waitpid_or_die(pid, status, options) \
+    ({ pid_t rc = waitpid(pid, status, options); assert(rc >= 0); rc; })
 #define gethostname_or_die(name, len) \
     ({ int rc = gethostname(name, len); assert(rc == 0); rc; })
 #define setenv_or_die(name, value, overwrite) \
@@ -78,18 +90,69 @@ typedef struct sockaddr sockaddr_t;
     ({ struct hostent *p = gethostbyname(name); assert(p != NULL); p; })
 #define gethostbyaddr_or_die(addr, len, type) \
     ({ struct hostent *p = gethostbyaddr(addr, len, type); assert(p != NULL); p; })
+#define epoll_create1_or_die(flags) \
+    ({ int rc = epoll_create1(flags); assert(rc >= 0); rc; })
+#define epoll_ctl_or_die(epfd, op, fd, event) \
+    assert(epoll_ctl(epfd, op, fd, event) == 0);
+#define malloc_or_die(size) \
+    ({ void *ptr = malloc(size); assert(ptr != NULL); ptr; })
+#define pthread_create_or_die(thread, attr, start_routine, arg) \
+    assert(pthread_create(thread, attr, start_routine, arg) == 0);
+#define pthread_mutex_init_or_die(mutex, attr) \
+    assert(pthread_mutex_init(mutex, attr) == 0);
+#define pthread_mutex_lock_or_die(mutex) \
+    assert(pthread_mutex_lock(mutex) == 0);
+#define pthread_mutex_unlock_or_die(mutex) \
+    assert(pthread_mutex_unlock(mutex) == 0);
+#define pthread_cond_init_or_die(cond, attr) \
+    assert(pthread_cond_init(cond, attr) == 0);
+#define pthread_cond_wait_or_die(cond, mutex) \
+    assert(pthread_cond_wait(cond, mutex) == 0);
+#define pthread_cond_signal_or_die(cond) \
+    assert(pthread_cond_signal(cond) == 0);
+
+// The _or_die wrappers above are for startup and for the clients: on the
+// per-request path of the server a failure (EMFILE, ECONNRESET, EAGAIN
+// from fork, ...) belongs to one request, not the whole server. These
+// report it and hand the result back, and the caller gives up on that
+// request only.
+#define fork_or_warn() \
+    ({ pid_t pid = fork(); if (pid < 0) perror("fork"); pid; })
+#define open_or_warn(pathname, flags, mode) \
+    ({ int rc = open(pathname, flags, mode); if (rc < 0 && (errno == EMFILE || errno == ENFILE)) perror(pathname); rc; })
+#define close_or_warn(fd) \
+    ({ int rc = close(fd); if (rc < 0 && errno != EINTR) perror("close"); rc; })
+#define epoll_ctl_or_warn(epfd, op, fd, event) \
+    ({ int rc = epoll_ctl(epfd, op, fd, event); if (rc < 0) perror("epoll_ctl"); rc; })
+
+// buffered reader; see io_helper.c
+#define RIO_BUFSIZE (8192)
+
+typedef struct {
+    int fd;
+    size_t start;                // first unread byte
+    size_t end;                  // one past the last buffered byte
+    int read_secs;               // time allowed for one request; 0 = none
+    time_t deadline;             // when the request being read times out
+    char buf[RIO_BUFSIZE + 1];   // + 1 keeps the data NUL-terminated
+} rio_t;
+
+void rio_init(rio_t *rp, int fd);
+ssize_t rio_fill(rio_t *rp);
+ssize_t rio_readline(rio_t *rp, char **linep);
+int rio_fill_headers(rio_t *rp);
+int rio_discard(rio_t *rp, size_t *remaining);
 
 // client/server helper functions 
-ssize_t readline(int fd, void *buf, size_t maxlen);
 int open_client_fd(char *hostname, int portno);
-int open_listen_fd(int portno);
+int open_listen_fd(int portno, int reuseport, int backlog);
 
 // wrappers for above
-#define readline_or_die(fd, buf, maxlen) \
-    ({ ssize_t rc = readline(fd, buf, maxlen); assert(rc >= 0); rc; })
+#define rio_readline_or_die(rp, linep) \
+    ({ ssize_t rc = rio_readline(rp, linep); assert(rc >= 0); rc; })
 #define open_client_fd_or_die(hostname, port) \
     ({ int rc = open_client_fd(hostname, port); assert(rc >= 0); rc; })
-#define open_listen_fd_or_die(port) \
-    ({ int rc = open_listen_fd(port); assert(rc >= 0); rc; })
+#define open_listen_fd_or_die(port, reuseport, backlog) \
+    ({ int rc = open_listen_fd(port, reuseport, backlog); assert(rc >= 0); rc; })
 
 #endif // __IO_HELPER__
@@ -1,180 +1,1109 @@
 #include "io_helper.h"
 #include "request.h"
+#include "cache.h"
+#include "cgi.h"
+#include "stats.h"
+#include "gzip.h"
 
 //
 // Some of this code stolen from Bryant/O'Halloran
 // Hopefully this is not a problem ... :)
 //
 
-#define MAXBUF (8192)
+// how often a worker idling on a persistent connection checks its buffer
+#define IDLE_SLICE_MS (50)
+
+// keep-alive limits, set from the command line
+int request_keepalive_max = REQUEST_KEEPALIVE_MAX;
+int request_idle_secs = REQUEST_IDLE_SECS;
+
+// overload limits, set from the command line
+int request_max_in_flight = REQUEST_MAX_IN_FLIGHT;
+int request_read_secs = REQUEST_READ_SECS;
+int request_write_secs = REQUEST_WRITE_SECS;
+
+// connections accepted and not yet closed, across all shards
+static int in_flight = 0;
+
+// Constant header fragments; a reply's header is gathered from these
+#define FRAGMENT(s) { s, sizeof(s) - 1 }
+
+static slice_t status_ok = FRAGMENT("HTTP/1.1 200 OK\r\nServer: OSTEP WebServer\r\n");
+static slice_t status_partial = FRAGMENT("HTTP/1.1 206 Partial Content\r\nServer: OSTEP WebServer\r\n");
+static slice_t status_not_modified = FRAGMENT("HTTP/1.1 304 Not Modified\r\nServer: OSTEP WebServer\r\n");
+static slice_t status_unsatisfiable = FRAGMENT("HTTP/1.1 416 Range Not Satisfiable\r\n"
+					       "Server: OSTEP WebServer\r\n");
+static slice_t connection_header[2] = {
+    FRAGMENT("Connection: close\r\n"),
+    FRAGMENT("Connection: keep-alive\r\n"),
+};
+static slice_t no_store = FRAGMENT("Cache-Control: no-store\r\n");
+static slice_t accept_ranges = FRAGMENT("Accept-Ranges: bytes\r\n");
+static slice_t header_end = FRAGMENT("\r\n");
+static slice_t empty_body = FRAGMENT("Content-Length: 0\r\n\r\n");
+static slice_t content_encoding_gzip = FRAGMENT("Content-Encoding: gzip\r\n");
+static slice_t vary_encoding = FRAGMENT("Vary: Accept-Encoding\r\n");
+
+// The whole reply to a connection turned away under load
+static slice_t overloaded = FRAGMENT("HTTP/1.1 503 Service Unavailable\r\n"
+				     "Server: OSTEP WebServer\r\n"
+				     "Retry-After: " REQUEST_RETRY_AFTER "\r\n"
+				     "Connection: close\r\n"
+				     "Content-Length: 0\r\n\r\n");
+
+// Separates the parts of a multi-range reply
+#define RANGE_BOUNDARY "OSTEP_WebServer_byteranges"
+static slice_t multipart_type = FRAGMENT("Content-Type: multipart/byteranges; boundary="
+					 RANGE_BOUNDARY "\r\n\r\n");
+
+//
+// Content types by file extension. Each entry holds the rest of the
+// header, pre-rendered, since Content-Type is always the last line, and
+// whether the type is text-like enough to be worth gzipping.
+//
+typedef struct {
+    char *ext;
+    slice_t header;
+    int compress;
+} mime_t;
+
+#define MIME(ext, type, compress) { ext, FRAGMENT("Content-Type: " type "\r\n\r\n"), compress }
+
+static mime_t mime_types[] = {
+    MIME("css", "text/css", 1),
+    MIME("gif", "image/gif", 0),
+    MIME("gz", "application/gzip", 0),
+    MIME("htm", "text/html", 1),
+    MIME("html", "text/html", 1),
+    MIME("ico", "image/x-icon", 0),
+    MIME("jpeg", "image/jpeg", 0),
+    MIME("jpg", "image/jpeg", 0),
+    MIME("js", "text/javascript", 1),
+    MIME("json", "application/json", 1),
+    MIME("mp4", "video/mp4", 0),
+    MIME("pdf", "application/pdf", 0),
+    MIME("png", "image/png", 0),
+    MIME("svg", "image/svg+xml", 1),
+    MIME("txt", "text/plain", 1),
+    MIME("wasm", "application/wasm", 1),
+    MIME("webp", "image/webp", 0),
+    MIME("xml", "application/xml", 1),
+};
+// unknown types are served as text, but may well not be
+static mime_t mime_default = MIME("", "text/plain", 0);
+
+#define NUM_MIME_TYPES (sizeof(mime_types) / sizeof(mime_types[0]))
+
+static int mime_compare(const void *key, const void *entry) {
+    return strcasecmp(key, ((mime_t *) entry)->ext);
+}
+
+//
+// Looks the filename's extension up in mime_types (kept sorted, for
+// bsearch); anything unknown is served as text/plain
+//
+static mime_t *request_get_filetype(char *filename) {
+    char *dot = strrchr(filename, '.');
+    if (dot == NULL || strchr(dot, '/'))
+	return &mime_default;
+    mime_t *m = bsearch(dot + 1, mime_types, NUM_MIME_TYPES, sizeof(mime_t), mime_compare);
+    return m ? m : &mime_default;
+}
+
+// Appends a run of memory to resp
+static void response_add(response_t *resp, void *p, size_t len) {
+    assert(resp->count < RESPONSE_PARTS);
+    resp->parts[resp->count++] = (response_part_t) { p, 0, len };
+    resp->len += len;
+}
+
+// Appends len bytes of the body at off: from memory if body is set,
+// else from resp->body_fd
+static void response_add_body(response_t *resp, char *body, off_t off, size_t len) {
+    if (len == 0)
+	return; // an empty last part would leave the header corked by MSG_MORE
+    if (body) {
+	response_add(resp, body + off, len);
+	return;
+    }
+    assert(resp->count < RESPONSE_PARTS);
+    resp->parts[resp->count++] = (response_part_t) { NULL, off, len };
+    resp->len += len;
+}
+
+static void response_add_slice(response_t *resp, slice_t *s) {
+    response_add(resp, s->p, s->len);
+}
+
+// Renders "Content-Length: n" into resp and adds it
+static void response_add_length(response_t *resp, size_t n) {
+    char digits[24];
+    int i = sizeof(digits);
+    do {
+	digits[--i] = '0' + n % 10;
+	n /= 10;
+    } while (n > 0);
+    static char name[] = "Content-Length: ";
+    size_t len = sizeof(name) - 1;
+    memcpy(resp->length, name, len);
+    memcpy(resp->length + len, digits + i, sizeof(digits) - i);
+    len += sizeof(digits) - i;
+    resp->length[len++] = '\r';
+    resp->length[len++] = '\n';
+    response_add(resp, resp->length, len);
+}
+
+//
+// Builds an error response (header and body together) into resp
+//
+void request_error(response_t *resp, char *cause, char *errnum, char *shortmsg, char *longmsg) {
+    char *body;
 
-void request_error(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg) {
-    char buf[MAXBUF], body[MAXBUF];
-    
     // Create the body of error message first (have to know its length for header)
-    sprintf(body, ""
-	    "<!doctype html>\r\n"
-	    "<head>\r\n"
-	    "  <title>OSTEP WebServer Error</title>\r\n"
-	    "</head>\r\n"
-	    "<body>\r\n"
-	    "  <h2>%s: %s</h2>\r\n" 
-	    "  <p>%s: %s</p>\r\n"
-	    "</body>\r\n"
-	    "</html>\r\n", errnum, shortmsg, longmsg, cause);
-    
-    // Write out the header information for this response
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    write_or_die(fd, buf, strlen(buf));
-    
-    sprintf(buf, "Content-Type: text/html\r\n");
-    write_or_die(fd, buf, strlen(buf));
-    
-    sprintf(buf, "Content-Length: %lu\r\n\r\n", strlen(body));
-    write_or_die(fd, buf, strlen(buf));
-    
-    // Write out the body last
-    write_or_die(fd, body, strlen(body));
-}
-
-//
-// Reads and discards everything up to an empty text line
-//
-void request_read_headers(int fd) {
-    char buf[MAXBUF];
-    
-    readline_or_die(fd, buf, MAXBUF);
-    while (strcmp(buf, "\r\n")) {
-	readline_or_die(fd, buf, MAXBUF);
-    }
-    return;
-}
-
-//
-// Return 1 if static, 0 if dynamic content
-// Calculates filename (and cgiargs, for dynamic) from uri
-//
-int request_parse_uri(char *uri, char *filename, char *cgiargs) {
-    char *ptr;
-    
-    if (!strstr(uri, "cgi")) { 
-	// static
-	strcpy(cgiargs, "");
-	sprintf(filename, ".%s", uri);
-	if (uri[strlen(uri)-1] == '/') {
-	    strcat(filename, "index.html");
+    int body_len = asprintf(&body, ""
+			    "<!doctype html>\r\n"
+			    "<head>\r\n"
+			    "  <title>OSTEP WebServer Error</title>\r\n"
+			    "</head>\r\n"
+			    "<body>\r\n"
+			    "  <h2>%s: %s</h2>\r\n"
+			    "  <p>%s: %s</p>\r\n"
+			    "</body>\r\n"
+			    "</html>\r\n", errnum, shortmsg, longmsg, cause);
+    assert(body_len >= 0);
+
+    // Header information for this response, then the body
+    int len = asprintf(&resp->alloc, ""
+		       "HTTP/1.1 %s %s\r\n"
+		       "%s"
+		       "Content-Type: text/html\r\n"
+		       "Content-Length: %d\r\n\r\n"
+		       "%s",
+		       errnum, shortmsg, connection_header[resp->keep_alive].p, body_len, body);
+    assert(len >= 0);
+    free(body);
+
+    resp->status = atoi(errnum);
+    response_add(resp, resp->alloc, len);
+}
+
+// Case-insensitive search for a token in a header value
+static int slice_has_token(slice_t *s, char *token) {
+    size_t n = strlen(token);
+    for (size_t i = 0; i + n <= s->len; i++)
+	if (strncasecmp(s->p + i, token, n) == 0)
+	    return 1;
+    return 0;
+}
+
+//
+// Whether a list like "gzip, deflate;q=0.5" accepts the given coding:
+// it is listed, and not with a quality of zero
+//
+static int slice_accepts(slice_t *s, char *coding) {
+    size_t n = strlen(coding);
+    for (size_t i = 0; i + n <= s->len; i++) {
+	if (strncasecmp(s->p + i, coding, n) || (i > 0 && isalnum(s->p[i - 1])))
+	    continue;
+	char *p = s->p + i + n, *end = s->p + s->len;
+	while (p < end && *p == ' ')
+	    p++;
+	if (p == end || *p == ',')
+	    return 1;
+	if (*p != ';')
+	    continue;
+	for (p++; p < end && *p == ' '; p++)
+	    ;
+	if (end - p < 3 || strncasecmp(p, "q=", 2))
+	    return 1;
+	// q=0, q=0.0, q=0.00 ... refuse it
+	for (p += 2; p < end && (*p == '0' || *p == '.'); p++)
+	    ;
+	return p < end && isdigit(*p);
+    }
+    return 0;
+}
+
+// Splits off the next space-separated word of s
+static slice_t slice_word(slice_t *s) {
+    while (s->len > 0 && *s->p == ' ') {
+	s->p++;
+	s->len--;
+    }
+    char *space = memchr(s->p, ' ', s->len);
+    slice_t word = { s->p, space ? space - s->p : s->len };
+    s->p += word.len;
+    s->len -= word.len;
+    return word;
+}
+
+// Trims the line end (and any spaces) off the end of s
+static void slice_trim(slice_t *s) {
+    while (s->len > 0 && (s->p[s->len - 1] == '\n' || s->p[s->len - 1] == '\r' || s->p[s->len - 1] == ' '))
+	s->len--;
+}
+
+//
+// Splits the request line (n bytes at p) into method, uri and version.
+// A line without a method and uri leaves method empty.
+//
+static void request_parse_line(char *p, size_t n, request_t *req) {
+    req->line = (slice_t) { p, n };
+    slice_trim(&req->line);
+    slice_t rest = req->line;
+    req->method = slice_word(&rest);
+    req->uri = slice_word(&rest);
+    req->version = slice_word(&rest);
+    if (req->uri.len == 0)
+	req->method.len = 0;
+}
+
+//
+// Request headers the server looks at; the rest are skipped
+//
+#define HEADER_CONNECTION        (0)
+#define HEADER_CONTENT_LENGTH    (1)
+#define HEADER_RANGE             (2)
+#define HEADER_IF_NONE_MATCH     (3)
+#define HEADER_IF_MODIFIED_SINCE (4)
+#define HEADER_ACCEPT_ENCODING   (5)
+
+static struct {
+    slice_t name;
+    int id;
+} request_headers[] = {
+    { FRAGMENT("Connection"), HEADER_CONNECTION },
+    { FRAGMENT("Content-Length"), HEADER_CONTENT_LENGTH },
+    { FRAGMENT("Range"), HEADER_RANGE },
+    { FRAGMENT("If-None-Match"), HEADER_IF_NONE_MATCH },
+    { FRAGMENT("If-Modified-Since"), HEADER_IF_MODIFIED_SINCE },
+    { FRAGMENT("Accept-Encoding"), HEADER_ACCEPT_ENCODING },
+};
+
+#define NUM_REQUEST_HEADERS (sizeof(request_headers) / sizeof(request_headers[0]))
+
+static void request_header(request_t *req, slice_t name, slice_t value) {
+    int id = -1;
+    for (int i = 0; i < NUM_REQUEST_HEADERS; i++)
+	if (name.len == request_headers[i].name.len &&
+	    strncasecmp(name.p, request_headers[i].name.p, name.len) == 0) {
+	    id = request_headers[i].id;
+	    break;
 	}
-	return 1;
-    } else { 
-	// dynamic
-	ptr = index(uri, '?');
-	if (ptr) {
-	    strcpy(cgiargs, ptr+1);
-	    *ptr = '\0';
-	} else {
-	    strcpy(cgiargs, "");
+
+    switch (id) {
+    case HEADER_CONNECTION:
+	if (slice_has_token(&value, "close"))
+	    req->keep_alive = 0;
+	else if (slice_has_token(&value, "keep-alive"))
+	    req->keep_alive = 1;
+	break;
+    case HEADER_CONTENT_LENGTH:
+	req->content_length = 0;
+	for (size_t i = 0; i < value.len && isdigit(value.p[i]); i++)
+	    req->content_length = req->content_length * 10 + (value.p[i] - '0');
+	break;
+    case HEADER_RANGE:
+	req->range = value;
+	break;
+    case HEADER_IF_NONE_MATCH:
+	req->if_none_match = value;
+	break;
+    case HEADER_IF_MODIFIED_SINCE:
+	req->if_modified_since = value;
+	break;
+    case HEADER_ACCEPT_ENCODING:
+	req->accept_gzip = slice_accepts(&value, "gzip");
+	break;
+    }
+}
+
+//
+// Takes a fully buffered request apart in one pass over it: the request
+// line into method, uri and version, and the headers up to the empty
+// line, noting the ones that decide whether the connection can carry
+// another request. Nothing is copied; req's slices point into rio's
+// buffer. rio_fill_headers must have returned 1 first.
+//
+void request_read_headers(rio_t *rio, request_t *req) {
+    char *line;
+    unsigned long start = stats_now();
+    ssize_t n = rio_readline(rio, &line);
+    request_parse_line(line, n, req);
+
+    // HTTP/1.1 connections persist unless the client says otherwise;
+    // HTTP/1.0 ones only if it asks
+    req->keep_alive = (req->version.len == 8 && strncmp(req->version.p, "HTTP/1.1", 8) == 0);
+    req->content_length = 0;
+    req->range = req->if_none_match = req->if_modified_since = (slice_t) { NULL, 0 };
+    req->accept_gzip = 0;
+
+    while ((n = rio_readline(rio, &line)) > 0 && line[0] != '\n' && strncmp(line, "\r\n", 2)) {
+	char *colon = memchr(line, ':', n);
+	if (colon == NULL)
+	    continue;
+	slice_t name = { line, colon - line };
+	slice_t value = { colon + 1, n - (colon + 1 - line) };
+	slice_trim(&value);
+	while (value.len > 0 && *value.p == ' ') {
+	    value.p++;
+	    value.len--;
 	}
-	sprintf(filename, ".%s", uri);
-	return 0;
+	request_header(req, name, value);
     }
+    req->start = start;
+    stats_record(STATS_PARSE, stats_now() - start);
 }
 
 //
-// Fills in the filetype given the filename
+// Return 1 if static, 0 if dynamic content, -1 if the uri is too long.
+// Calculates filename (and cgiargs, for dynamic) from the uri into
+// req->path.
 //
-void request_get_filetype(char *filename, char *filetype) {
-    if (strstr(filename, ".html")) 
-	strcpy(filetype, "text/html");
-    else if (strstr(filename, ".gif")) 
-	strcpy(filetype, "image/gif");
-    else if (strstr(filename, ".jpg")) 
-	strcpy(filetype, "image/jpeg");
-    else 
-	strcpy(filetype, "text/plain");
+static int request_parse_uri(request_t *req) {
+    slice_t uri = req->uri, query = { "", 0 };
+    int is_static = (memmem(uri.p, uri.len, "cgi", 3) == NULL);
+    char *mark = memchr(uri.p, '?', uri.len);
+    if (mark) {
+	query = (slice_t) { mark + 1, uri.len - (mark + 1 - uri.p) };
+	uri.len = mark - uri.p;
+    }
+
+    // "." uri ["index.html"] NUL query NUL
+    int index = (is_static && uri.len > 0 && uri.p[uri.len - 1] == '/');
+    size_t need = 1 + uri.len + (index ? 10 : 0) + 1 + query.len + 1;
+    if (need > REQUEST_PATH_MAX)
+	return -1;
+    char *p = req->path;
+    *p++ = '.';
+    memcpy(p, uri.p, uri.len);
+    p += uri.len;
+    if (index) {
+	memcpy(p, "index.html", 10);
+	p += 10;
+    }
+    *p++ = '\0';
+    req->filename = req->path;
+    req->cgiargs = p;
+    if (!is_static) {
+	memcpy(p, query.p, query.len);
+	p += query.len;
+    }
+    *p = '\0';
+    return is_static;
 }
 
-void request_serve_dynamic(int fd, char *filename, char *cgiargs) {
-    char buf[MAXBUF], *argv[] = { NULL };
-    
-    // The server does only a little bit of the header.  
+static slice_t dynamic_header = FRAGMENT("HTTP/1.1 200 OK\r\n"
+					 "Server: OSTEP WebServer\r\n"
+					 "Connection: close\r\n");
+
+//
+// Starts the CGI program for a request, with its output going straight
+// to fd: the server writes the start of the header and the program does
+// the rest. Uses a persistent worker when -f is in effect, else forks.
+// Returns the pid of a forked child, 0 if a worker took the request, or
+// -1 if the client is gone or no process could be started for it (the
+// connection is then just closed).
+//
+pid_t request_start_dynamic(int fd, char *filename, char *cgiargs) {
+    char *argv[] = { NULL };
+    pid_t pid;
+
+    // The server does only a little bit of the header.
     // The CGI script has to finish writing out the header.
-    sprintf(buf, ""
-	    "HTTP/1.0 200 OK\r\n"
-	    "Server: OSTEP WebServer\r\n");
-    
-    write_or_die(fd, buf, strlen(buf));
-    
-    if (fork_or_die() == 0) {                        // child
+    // Its output runs until it is done, so the connection ends with it.
+    if (send(fd, dynamic_header.p, dynamic_header.len, MSG_NOSIGNAL) < 0)
+	return -1;
+
+    if (cgi_workers > 0 && cgi_dispatch(fd, filename, cgiargs) == 0)
+	return 0;
+
+    if ((pid = fork_or_warn()) == 0) {               // child
 	setenv_or_die("QUERY_STRING", cgiargs, 1);   // args to cgi go here
 	dup2_or_die(fd, STDOUT_FILENO);              // make cgi writes go to socket (not screen)
-	extern char **environ;                       // defined by libc 
+	extern char **environ;                       // defined by libc
 	execve_or_die(filename, argv, environ);
+    }
+    return pid;
+}
+
+//
+// Other threads fork CGI programs too, so reap exactly our own child;
+// wait(NULL) could take someone else's
+//
+void request_serve_dynamic(int fd, char *filename, char *cgiargs) {
+    pid_t pid = request_start_dynamic(fd, filename, cgiargs);
+    if (pid > 0)
+	waitpid_or_die(pid, NULL, 0);
+}
+
+//
+// Renders the validators for a file from its stat: a strong ETag made
+// of inode, size and mtime (to the nanosecond), plus a suffix telling
+// encodings of the same file apart, and Last-Modified
+//
+static void render_validators(response_t *resp, struct stat *sbuf, char *suffix) {
+    snprintf(resp->etag, sizeof(resp->etag), "ETag: \"%lx-%llx-%llx%s\"\r\n",
+	     (unsigned long) sbuf->st_ino, (unsigned long long) sbuf->st_size,
+	     (unsigned long long) sbuf->st_mtim.tv_sec * 1000000000ULL + sbuf->st_mtim.tv_nsec, suffix);
+    struct tm tm;
+    gmtime_r(&sbuf->st_mtim.tv_sec, &tm);
+    strftime(resp->modified, sizeof(resp->modified), "Last-Modified: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+}
+
+// Ranges are only offered on the file as stored, not on gzipped copies
+static void response_add_validators(response_t *resp, mime_t *mime, int gzip) {
+    if (mime->compress)
+	response_add_slice(resp, &vary_encoding);
+    response_add(resp, resp->etag, strlen(resp->etag));
+    response_add(resp, resp->modified, strlen(resp->modified));
+    if (!gzip)
+	response_add_slice(resp, &accept_ranges);
+}
+
+//
+// Gathers a static 200 reply's header into resp; its validators must
+// have been rendered already
+//
+static void static_header(response_t *resp, size_t size, mime_t *mime, int gzip) {
+    response_add_slice(resp, &status_ok);
+    response_add_slice(resp, &connection_header[resp->keep_alive]);
+    response_add_length(resp, size);
+    if (gzip)
+	response_add_slice(resp, &content_encoding_gzip);
+    response_add_validators(resp, mime, gzip);
+    response_add_slice(resp, &mime->header);
+}
+
+// Flattens a static reply's header into one string, for the cache
+static char *render_static_header(response_t *resp, int keep_alive, size_t size, mime_t *mime,
+				  int gzip, size_t *len) {
+    response_t *r = malloc_or_die(sizeof(response_t));
+    response_init(r);
+    r->keep_alive = keep_alive;
+    strcpy(r->etag, resp->etag);
+    strcpy(r->modified, resp->modified);
+    static_header(r, size, mime, gzip);
+    char *head = malloc_or_die(r->len + 1), *p = head;
+    for (int i = 0; i < r->count; i++) {
+	memcpy(p, r->parts[i].p, r->parts[i].len);
+	p += r->parts[i].len;
+    }
+    *p = '\0';
+    *len = r->len;
+    free(r);
+    return head;
+}
+
+// Reads a whole file into a new buffer; NULL if it cannot
+static char *read_file(char *filename, size_t size) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+	return NULL;
+    char *data = malloc_or_die(size > 0 ? size : 1);
+    size_t got = 0;
+    while (got < size) {
+	ssize_t n = pread(fd, data + got, size - got, got);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    break;
+	got += n;
+    }
+    close_or_warn(fd);
+    if (got < size) {
+	free(data);
+	return NULL;
+    }
+    return data;
+}
+
+//
+// Whether the client's copy is still good: If-None-Match against the
+// ETag, or failing that, If-Modified-Since against the mtime
+//
+static int request_not_modified(request_t *req, response_t *resp, struct stat *sbuf) {
+    if (req->if_none_match.len > 0) {
+	// the tag without its header name and line end
+	char *tag = resp->etag + 6;
+	size_t tag_len = strlen(tag) - 2;
+	if (req->if_none_match.len == 1 && req->if_none_match.p[0] == '*')
+	    return 1;
+	return memmem(req->if_none_match.p, req->if_none_match.len, tag, tag_len) != NULL;
+    }
+    if (req->if_modified_since.len > 0) {
+	char date[64];
+	struct tm tm;
+	memset(&tm, 0, sizeof(tm));
+	snprintf(date, sizeof(date), "%.*s", (int) req->if_modified_since.len, req->if_modified_since.p);
+	if (strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm) == NULL)
+	    return 0;
+	return sbuf->st_mtime <= timegm(&tm);
+    }
+    return 0;
+}
+
+typedef struct {
+    off_t first, last;   // inclusive
+} range_t;
+
+//
+// Reads the number at *p. Any value past size means the same in a range
+// as size itself, so it stops growing there instead of overflowing.
+//
+static off_t range_number(char **p, char *end, off_t size) {
+    off_t v = 0;
+    for (; *p < end && isdigit(**p); (*p)++) {
+	int d = **p - '0';
+	v = (d > size || v > (size - d) / 10) ? size : v * 10 + d;
+    }
+    return v;
+}
+
+//
+// Parses a Range header ("bytes=0-99,200-,-50") against a file of the
+// given size. Returns the number of satisfiable ranges found; 0 if the
+// header is absent, malformed, or asks for too many ranges (the whole
+// file is sent then); -1 if none of the ranges can be satisfied.
+//
+static int request_parse_ranges(slice_t *header, off_t size, range_t *ranges) {
+    if (header->len < 6 || strncasecmp(header->p, "bytes=", 6))
+	return 0;
+    char *p = header->p + 6, *end = header->p + header->len;
+    int n = 0, specs = 0;
+    while (p < end) {
+	while (p < end && (*p == ' ' || *p == ','))
+	    p++;
+	if (p == end)
+	    break;
+	off_t first = -1, last = -1;
+	if (isdigit(*p))
+	    first = range_number(&p, end, size);
+	if (p == end || *p++ != '-')
+	    return 0;
+	if (p < end && isdigit(*p))
+	    last = range_number(&p, end, size);
+	if (p < end && *p != ',' && *p != ' ')
+	    return 0;
+	if (++specs > REQUEST_MAX_RANGES)
+	    return 0;
+
+	if (first < 0) {
+	    // suffix: the last 'last' bytes
+	    if (last <= 0)
+		continue;
+	    first = last < size ? size - last : 0;
+	    last = size - 1;
+	} else if (last >= 0 && last < first) {
+	    return 0;
+	} else if (last < 0 || last >= size) {
+	    last = size - 1;
+	}
+	if (first >= size)
+	    continue;
+	ranges[n++] = (range_t) { first, last };
+    }
+    return n > 0 ? n : (specs > 0 ? -1 : 0);
+}
+
+//
+// Fills in resp with the parts of a 206 reply: one range sent as is, or
+// several as multipart/byteranges, each preceded by its own small
+// header. The data comes from body if set, else from resp->body_fd.
+//
+static void partial_reply(response_t *resp, char *body, off_t size, mime_t *mime,
+			  range_t *ranges, int n) {
+    resp->status = 206;
+    response_add_slice(resp, &status_partial);
+    response_add_slice(resp, &connection_header[resp->keep_alive]);
+    if (n == 1) {
+	size_t len = ranges[0].last - ranges[0].first + 1;
+	response_add_length(resp, len);
+	snprintf(resp->range, sizeof(resp->range), "Content-Range: bytes %lld-%lld/%lld\r\n",
+		 (long long) ranges[0].first, (long long) ranges[0].last, (long long) size);
+	response_add(resp, resp->range, strlen(resp->range));
+	response_add_validators(resp, mime, 0);
+	response_add_slice(resp, &mime->header);
+	response_add_body(resp, body, ranges[0].first, len);
+	return;
+    }
+
+    // part headers all go in one allocation; the file data is not copied
+    size_t type_len = mime->header.len - 2; // its line end only
+    size_t room = n * (type_len + 128) + 64, used = 0, body_len = 0;
+    resp->alloc = malloc_or_die(room);
+    size_t *offsets = malloc_or_die(sizeof(size_t) * (n + 1));
+    for (int i = 0; i < n; i++) {
+	offsets[i] = used;
+	used += snprintf(resp->alloc + used, room - used, "%s--" RANGE_BOUNDARY "\r\n%.*s"
+			 "Content-Range: bytes %lld-%lld/%lld\r\n\r\n",
+			 i > 0 ? "\r\n" : "", (int) type_len, mime->header.p,
+			 (long long) ranges[i].first, (long long) ranges[i].last, (long long) size);
+	body_len += ranges[i].last - ranges[i].first + 1;
+    }
+    offsets[n] = used;
+    used += snprintf(resp->alloc + used, room - used, "\r\n--" RANGE_BOUNDARY "--\r\n");
+    body_len += used;
+
+    response_add_length(resp, body_len);
+    response_add_validators(resp, mime, 0);
+    response_add_slice(resp, &multipart_type);
+    for (int i = 0; i < n; i++) {
+	response_add(resp, resp->alloc + offsets[i], offsets[i + 1] - offsets[i]);
+	response_add_body(resp, body, ranges[i].first, ranges[i].last - ranges[i].first + 1);
+    }
+    response_add(resp, resp->alloc + offsets[n], used - offsets[n]);
+    free(offsets);
+}
+
+//
+// The gzipped copy of a file, from the cache, or compressed and added
+// to it on the first request. Kept under a key no real path has, and
+// revalidated against the original file like any other entry. resp's
+// validators must already be rendered for the gzipped copy.
+//
+static cache_entry_t *gzip_entry(response_t *resp, char *filename, struct stat *sbuf, mime_t *mime) {
+    char key[REQUEST_PATH_MAX + 8];
+    snprintf(key, sizeof(key), "gzip:%s", filename);
+    cache_entry_t *e = cache_lookup(key, sbuf);
+    if (e)
+	return e;
+
+    char *data = read_file(filename, sbuf->st_size);
+    if (data == NULL)
+	return NULL;
+    size_t len;
+    char *body = gzip_compress(data, sbuf->st_size, &len);
+    free(data);
+    if (body == NULL)
+	return NULL;
+    char *head[2];
+    size_t head_len[2];
+    for (int keep_alive = 0; keep_alive < 2; keep_alive++)
+	head[keep_alive] = render_static_header(resp, keep_alive, len, mime, 1, &head_len[keep_alive]);
+    return cache_insert(key, sbuf, head, head_len, body, len);
+}
+
+//
+// Fills in resp for a static file. A client that accepts gzip gets, for
+// text-like types, a sibling .gz file if one is at least as new, or
+// else a copy compressed once and kept in the cache. A client whose copy
+// is current gets a 304 and a Range request a 206; otherwise the whole
+// file goes out. The body comes straight from the cache when it has a
+// fresh copy, else from loading the file into the cache if it is small
+// enough, else from opening it for response_write to send.
+//
+static void request_serve_static(request_t *req, response_t *resp, struct stat *sbuf) {
+    char *filename = req->filename, *body = NULL;
+    cache_entry_t *e = NULL;
+    mime_t *mime = request_get_filetype(filename);
+    int gzip = 0;
+    char gz_name[REQUEST_PATH_MAX + 3];
+    struct stat gz_sbuf;
+
+    if (req->accept_gzip && mime->compress) {
+	snprintf(gz_name, sizeof(gz_name), "%s.gz", filename);
+	if (stat(gz_name, &gz_sbuf) == 0 && S_ISREG(gz_sbuf.st_mode) && gz_sbuf.st_mtime >= sbuf->st_mtime) {
+	    // sent from disk like any file, but never cached under the
+	    // .gz name, whose own replies carry a different header
+	    gzip = 1;
+	    filename = gz_name;
+	    sbuf = &gz_sbuf;
+	} else if (sbuf->st_size >= GZIP_MIN_SIZE && cache_admits(sbuf->st_size)) {
+	    render_validators(resp, sbuf, "-gz");
+	    gzip = ((e = gzip_entry(resp, filename, sbuf, mime)) != NULL);
+	}
+    }
+    if (e == NULL)
+	render_validators(resp, sbuf, "");
+
+    if (request_not_modified(req, resp, sbuf)) {
+	if (e)
+	    cache_release(e);
+	resp->status = 304;
+	response_add_slice(resp, &status_not_modified);
+	response_add_slice(resp, &connection_header[resp->keep_alive]);
+	if (mime->compress)
+	    response_add_slice(resp, &vary_encoding);
+	response_add(resp, resp->etag, strlen(resp->etag));
+	response_add(resp, resp->modified, strlen(resp->modified));
+	response_add_slice(resp, &header_end);
+	return;
+    }
+
+    range_t ranges[REQUEST_MAX_RANGES];
+    int nranges = gzip ? 0 : request_parse_ranges(&req->range, sbuf->st_size, ranges);
+    if (nranges < 0) {
+	resp->status = 416;
+	snprintf(resp->range, sizeof(resp->range), "Content-Range: bytes */%lld\r\n",
+		 (long long) sbuf->st_size);
+	response_add_slice(resp, &status_unsatisfiable);
+	response_add_slice(resp, &connection_header[resp->keep_alive]);
+	response_add(resp, resp->range, strlen(resp->range));
+	response_add_slice(resp, &empty_body);
+	return;
+    }
+
+    if (!gzip && cache_enabled && (e = cache_lookup(filename, sbuf)) == NULL && cache_admits(sbuf->st_size)) {
+	if ((body = read_file(filename, sbuf->st_size)) != NULL) {
+	    char *head[2];
+	    size_t head_len[2];
+	    for (int keep_alive = 0; keep_alive < 2; keep_alive++)
+		head[keep_alive] = render_static_header(resp, keep_alive, sbuf->st_size, mime, 0,
+							&head_len[keep_alive]);
+	    e = cache_insert(filename, sbuf, head, head_len, body, sbuf->st_size);
+	}
+    }
+    size_t size = sbuf->st_size;
+    if (e) {
+	// pinned until the reply is out; no copies, nothing to render
+	resp->entry = e;
+	body = e->body;
+	size = e->body_len;
     } else {
-	wait_or_die(NULL);
-    }
-}
-
-void request_serve_static(int fd, char *filename, int filesize) {
-    int srcfd;
-    char *srcp, filetype[MAXBUF], buf[MAXBUF];
-    
-    request_get_filetype(filename, filetype);
-    srcfd = open_or_die(filename, O_RDONLY, 0);
-    
-    // Rather than call read() to read the file into memory, 
-    // which would require that we allocate a buffer, we memory-map the file
-    srcp = mmap_or_die(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
-    close_or_die(srcfd);
-    
-    // put together response
-    sprintf(buf, ""
-	    "HTTP/1.0 200 OK\r\n"
-	    "Server: OSTEP WebServer\r\n"
-	    "Content-Length: %d\r\n"
-	    "Content-Type: %s\r\n\r\n", 
-	    filesize, filetype);
-    
-    write_or_die(fd, buf, strlen(buf));
-    
-    //  Writes out to the client socket the memory-mapped file 
-    write_or_die(fd, srcp, filesize);
-    munmap_or_die(srcp, filesize);
-}
-
-// handle a request
-void request_handle(int fd) {
+	// Rather than read() the file into a buffer (or mmap it, which costs
+	// a page-table setup and teardown per request), keep it open and let
+	// sendfile() copy it to the socket inside the kernel
+	resp->body_fd = open_or_warn(filename, O_RDONLY, 0);
+	if (resp->body_fd < 0) {
+	    // out of descriptors (or it went away since the stat)
+	    request_error(resp, filename, "503", "Service Unavailable",
+			  "the server could not open this file");
+	    return;
+	}
+    }
+
+    if (nranges > 0) {
+	partial_reply(resp, body, size, mime, ranges, nranges);
+	return;
+    }
+    resp->status = 200;
+    if (e)
+	response_add(resp, e->head[resp->keep_alive], e->head_len[resp->keep_alive]);
+    else
+	static_header(resp, size, mime, gzip);
+    response_add_body(resp, body, 0, size);
+}
+
+//
+// Writes as much of resp to fd as the socket takes. Returns 1 once the
+// whole response is out, 0 if a non-blocking fd would block (call
+// again when it is writable), -1 on error, or with errno ETIMEDOUT once
+// the reply has taken more than request_write_secs: a client reading
+// it a trickle at a time does not get to hold the connection forever.
+//
+int response_write(int fd, response_t *resp) {
+    unsigned long now = stats_now();
+    if (resp->send_start == 0)
+	resp->send_start = now;
+    else if (request_write_secs > 0 &&
+	     now - resp->send_start > request_write_secs * 1000000UL) {
+	errno = ETIMEDOUT;
+	return -1;
+    }
+    while (resp->sent < resp->len) {
+	// find where an earlier short write left off
+	int i = 0;
+	size_t skip = resp->sent;
+	while (skip >= resp->parts[i].len)
+	    skip -= resp->parts[i++].len;
+
+	ssize_t rc;
+	if (resp->parts[i].p) {
+	    // a run of memory parts (header fragments, cached bodies) in one call
+	    struct iovec iov[RESPONSE_PARTS];
+	    int n = 0;
+	    for (; i < resp->count && resp->parts[i].p; i++, skip = 0) {
+		iov[n].iov_base = resp->parts[i].p + skip;
+		iov[n++].iov_len = resp->parts[i].len - skip;
+	    }
+	    // MSG_MORE holds a short header back so it leaves in the
+	    // same segment as the start of the file, not a packet of its own
+	    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = n };
+	    rc = sendmsg(fd, &msg, i < resp->count ? MSG_MORE : 0);
+	} else {
+	    off_t off = resp->parts[i].off + skip;
+	    rc = sendfile(fd, resp->body_fd, &off, resp->parts[i].len - skip);
+	    if (rc == 0)
+		return -1; // file shrank underneath us
+	}
+	if (rc < 0) {
+	    if (errno == EINTR)
+		continue;
+	    if (errno == EAGAIN || errno == EWOULDBLOCK)
+		return 0;
+	    return -1;
+	}
+	resp->sent += rc;
+    }
+    stats_record(STATS_SEND, stats_now() - resp->send_start);
+    stats_request_done(resp->line.p, resp->line.len, resp->status, resp->len,
+		       resp->start ? resp->start : resp->send_start);
+    return 1;
+}
+
+void response_init(response_t *resp) {
+    resp->count = 0;
+    resp->len = 0;
+    resp->alloc = NULL;
+    resp->body_fd = -1;
+    resp->sent = 0;
+    resp->keep_alive = 0;
+    resp->entry = NULL;
+    resp->status = 0;
+    resp->line = (slice_t) { NULL, 0 };
+    resp->start = resp->send_start = 0;
+}
+
+void response_free(response_t *resp) {
+    if (resp->entry)
+	cache_release(resp->entry);
+    free(resp->alloc);
+    if (resp->body_fd >= 0)
+	close_or_warn(resp->body_fd);
+    response_init(resp);
+}
+
+//
+// Look at (without consuming) the request line waiting on fd and compute
+// the filename it refers to, so the acceptor can schedule the connection
+// before a worker reads it. Never waits: returns 0 on success, -1 if the
+// whole request line is not there yet, and -2 if the connection is
+// closed or its request line is unusable.
+//
+int request_peek_filename(int fd, request_t *req) {
+    char buf[MAXBUF], *end;
+
+    ssize_t n = recv(fd, buf, MAXBUF, MSG_PEEK | MSG_DONTWAIT);
+    if (n == 0)
+	return -2;
+    if (n < 0)
+	return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? -1 : -2;
+    if ((end = memchr(buf, '\n', n)) == NULL && n < MAXBUF)
+	return -1;
+    request_parse_line(buf, end ? end - buf : n, req);
+    if (req->method.len == 0 || request_parse_uri(req) < 0)
+	return -2;
+    return 0;
+}
+
+//
+// Answers STATS_URI with the server's counters, as plain text
+//
+static void request_serve_stats(response_t *resp) {
+    size_t body_len;
+    resp->alloc = stats_render(&body_len);
+    resp->status = 200;
+    response_add_slice(resp, &status_ok);
+    response_add_slice(resp, &connection_header[resp->keep_alive]);
+    response_add_slice(resp, &no_store);
+    response_add_length(resp, body_len);
+    response_add_slice(resp, &request_get_filetype(".txt")->header);
+    response_add(resp, resp->alloc, body_len);
+}
+
+//
+// Given a request read by request_read_headers, fill in resp with the
+// static file or error to send back. Returns REQUEST_DYNAMIC, with
+// req->filename and req->cgiargs filled in, when a CGI program should
+// be run instead; otherwise REQUEST_STATIC.
+//
+int request_prepare(request_t *req, response_t *resp) {
     int is_static;
     struct stat sbuf;
-    char buf[MAXBUF], method[MAXBUF], uri[MAXBUF], version[MAXBUF];
-    char filename[MAXBUF], cgiargs[MAXBUF];
-    
-    readline_or_die(fd, buf, MAXBUF);
-    sscanf(buf, "%s %s %s", method, uri, version);
-    printf("method:%s uri:%s version:%s\n", method, uri, version);
-    
-    if (strcasecmp(method, "GET")) {
-	request_error(fd, method, "501", "Not Implemented", "server does not implement this method");
-	return;
+
+    response_init(resp);
+    resp->keep_alive = req->keep_alive;
+    resp->line = req->line;
+    resp->start = req->start;
+
+    if (req->method.len == 0) {
+	request_error(resp, "request", "400", "Bad Request", "server could not parse the request line");
+	return REQUEST_STATIC;
     }
-    request_read_headers(fd);
-    
-    is_static = request_parse_uri(uri, filename, cgiargs);
-    if (stat(filename, &sbuf) < 0) {
-	request_error(fd, filename, "404", "Not found", "server could not find this file");
-	return;
+    if (req->method.len != 3 || strncasecmp(req->method.p, "GET", 3)) {
+	char method[16];
+	snprintf(method, sizeof(method), "%.*s", (int) req->method.len, req->method.p);
+	request_error(resp, method, "501", "Not Implemented", "server does not implement this method");
+	return REQUEST_STATIC;
+    }
+
+    if (req->uri.len == sizeof(STATS_URI) - 1 && memcmp(req->uri.p, STATS_URI, req->uri.len) == 0) {
+	request_serve_stats(resp);
+	return REQUEST_STATIC;
     }
-    
+
+    unsigned long open_start = stats_now();
+    if ((is_static = request_parse_uri(req)) < 0) {
+	request_error(resp, "request", "414", "URI Too Long", "server could not handle this uri");
+	return REQUEST_STATIC;
+    }
+    if (stat(req->filename, &sbuf) < 0) {
+	request_error(resp, req->filename, "404", "Not found", "server could not find this file");
+	return REQUEST_STATIC;
+    }
+
     if (is_static) {
 	if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
-	    request_error(fd, filename, "403", "Forbidden", "server could not read this file");
-	    return;
+	    request_error(resp, req->filename, "403", "Forbidden", "server could not read this file");
+	    return REQUEST_STATIC;
 	}
-	request_serve_static(fd, filename, sbuf.st_size);
+	request_serve_static(req, resp, &sbuf);
+	stats_record(STATS_OPEN, stats_now() - open_start);
+	return REQUEST_STATIC;
     } else {
 	if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
-	    request_error(fd, filename, "403", "Forbidden", "server could not run this CGI program");
-	    return;
+	    request_error(resp, req->filename, "403", "Forbidden", "server could not run this CGI program");
+	    return REQUEST_STATIC;
+	}
+	stats_request_done(req->line.p, req->line.len, 0, 0, req->start);
+	return REQUEST_DYNAMIC;
+    }
+}
+
+//
+// Wait, for up to request_idle_secs, until the next request starts to
+// arrive on fd; returns 1 once it has, and 0 if the time ran out or
+// *queued shows a connection waiting for this worker. The client gets a
+// slice first, so one sending its requests back to back keeps its
+// connection rather than racing the close.
+//
+static int request_wait_next(int fd, int *queued) {
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    for (int waited = 0; waited < request_idle_secs * 1000; waited += IDLE_SLICE_MS) {
+	if (poll(&pfd, 1, IDLE_SLICE_MS) > 0)
+	    return 1;
+	if (__atomic_load_n(queued, __ATOMIC_RELAXED) > 0)
+	    return 0;
+    }
+    return 0;
+}
+
+//
+// Handle the requests arriving on a connection, in order, until the
+// client closes it, asks for it to be closed, goes quiet for longer
+// than request_idle_secs, or has sent request_keepalive_max requests.
+// While it is idle between requests, the connection is also closed as
+// soon as queued (when not NULL) shows other connections waiting for a
+// worker, so an idle client does not hold the worker; it reconnects, and
+// is scheduled again, when it has another request.
+//
+void request_handle(int fd, int *queued) {
+    response_t resp;
+    request_t req;
+    rio_t rio;
+
+    // reads give up with EAGAIN once the client has been idle too long,
+    // and a write that stalls for the whole write deadline with EAGAIN
+    struct timeval idle = { .tv_sec = request_idle_secs, .tv_usec = 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+    struct timeval stall = { .tv_sec = request_write_secs, .tv_usec = 0 };
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &stall, sizeof(stall));
+
+    rio_init(&rio, fd);
+    rio.read_secs = request_read_secs;
+    for (int served = 0; ; served++) {
+	int rc = rio_fill_headers(&rio);
+	if (rc < 0 && errno == ENOBUFS) {
+	    req.keep_alive = 0;
+	    response_init(&resp);
+	    request_error(&resp, "request", "400", "Bad Request", "request header too large");
+	} else if (rc < 0 && errno == ETIMEDOUT) {
+	    req.keep_alive = 0;
+	    response_init(&resp);
+	    request_error(&resp, "request", "408", "Request Timeout", "request took too long to arrive");
+	} else if (rc <= 0) {
+	    return; // client went away or idled out
+	} else {
+	    request_read_headers(&rio, &req);
+	    if (served + 1 >= request_keepalive_max)
+		req.keep_alive = 0;
+	    if (request_prepare(&req, &resp) == REQUEST_DYNAMIC) {
+		request_serve_dynamic(fd, req.filename, req.cgiargs);
+		return;
+	    }
 	}
-	request_serve_dynamic(fd, filename, cgiargs);
+	// the socket blocks, so 0 here means SO_SNDTIMEO ran out
+	rc = response_write(fd, &resp);
+	response_free(&resp);
+	if (rc <= 0 || !req.keep_alive)
+	    return;
+	// skip any request body so the next request lines up
+	if (rio_discard(&rio, &req.content_length) <= 0)
+	    return;
+	if (queued != NULL && rio.start == rio.end && !request_wait_next(fd, queued))
+	    return;
+    }
+}
+
+//
+// Admission control: every accepted connection is counted until it is
+// closed, and past request_max_in_flight new ones are shed rather than
+// queued, so a burst costs the late arrivals a cheap 503 instead of
+// costing everyone latency (and the server its descriptors). Returns 1
+// if fd may be served, in which case request_release must follow.
+//
+int request_admit(void) {
+    int n = __atomic_add_fetch(&in_flight, 1, __ATOMIC_RELAXED);
+    if (request_max_in_flight > 0 && n > request_max_in_flight) {
+	__atomic_sub_fetch(&in_flight, 1, __ATOMIC_RELAXED);
+	return 0;
     }
+    return 1;
+}
+
+void request_release(void) {
+    __atomic_sub_fetch(&in_flight, 1, __ATOMIC_RELAXED);
+}
+
+//
+// Sets up a connection just accepted, under either engine. Nagle is
+// turned off: replies already leave in as few sends as they can (the
+// header goes with MSG_MORE), so all it would do is hold back the last
+// short segment of a sendfile()'d body until the client's delayed ACK,
+// some 40 ms into every keep-alive reply.
+//
+void request_accepted(int fd) {
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+//
+// Turns a connection away: one non-blocking send of a canned 503 and a
+// close, without reading the request, let alone touching the disk. The
+// request is drained first if it is already there, since closing with
+// unread data resets the connection and the client may lose the reply.
+//
+void request_shed(int fd) {
+    char drain[1024];
+    unsigned long start = stats_now();
+    while (recv(fd, drain, sizeof(drain), MSG_DONTWAIT) == sizeof(drain))
+	;
+    send(fd, overloaded.p, overloaded.len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(fd);
+    stats_request_done(NULL, 0, 503, overloaded.len, start);
+}
+
+//
+// accept() failed with EMFILE or ENFILE: a connection is waiting that
+// there is no descriptor for, and the listener stays readable until it
+// is taken. Gives up the spare descriptor kept for this, sheds the
+// connection with it, then takes the spare back. Returns -1 if nothing
+// was shed: there is no spare, another thread used the slot first, or
+// the connection was gone (accept() reports EMFILE before it looks at
+// the queue). The caller should then stop accepting for
+// REQUEST_SHED_BACKOFF_MS instead of retrying at once.
+//
+int request_shed_overflow(int listen_fd, int *spare_fd) {
+    if (*spare_fd < 0)
+	*spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (*spare_fd < 0)
+	return -1;
+    close(*spare_fd);
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    int err = errno;
+    if (fd >= 0)
+	request_shed(fd);
+    *spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return (fd >= 0 || err == EINTR || err == ECONNABORTED) ? 0 : -1;
 }
@@ -1,5 +1,122 @@
 #ifndef __REQUEST_H__
+#define __REQUEST_H__
 
-void request_handle(int fd);
+#include <sys/types.h>
+#include "io_helper.h"
+
+#define MAXBUF (8192)
+
+// return values of request_prepare
+#define REQUEST_STATIC  (0)  // resp holds the whole reply (file or error)
+#define REQUEST_DYNAMIC (1)  // run the CGI program named in filename
+
+// defaults for the keep-alive limits below
+#define REQUEST_KEEPALIVE_MAX (100)  // requests served per connection
+#define REQUEST_IDLE_SECS     (5)    // idle time before a connection is closed
+
+extern int request_keepalive_max;
+extern int request_idle_secs;
+
+// defaults for the overload limits below
+#define REQUEST_MAX_IN_FLIGHT (0)    // connections held at once; 0 = no limit
+#define REQUEST_READ_SECS     (10)   // to read one request once it has begun
+#define REQUEST_WRITE_SECS    (60)   // to write one reply
+#define REQUEST_RETRY_AFTER   "1"    // seconds a shed client is told to wait
+#define REQUEST_SHED_BACKOFF_MS (10) // accepting pauses when out of descriptors
+
+extern int request_max_in_flight;
+extern int request_read_secs;
+extern int request_write_secs;
+
+// Longest resolved filename plus CGI arguments; longer URIs get a 414
+#define REQUEST_PATH_MAX (4096)
+
+// Ranges honoured in one request; asking for more gets the whole file
+#define REQUEST_MAX_RANGES (16)
+
+// Pieces of one reply: header fragments, then body runs (with a part
+// header before and a line end after each range of a multipart reply)
+#define RESPONSE_PARTS (16 + 3 * REQUEST_MAX_RANGES)
+
+//
+// A run of bytes inside some other buffer, usually the connection's
+// read buffer; not NUL-terminated
+//
+typedef struct {
+    char *p;
+    size_t len;
+} slice_t;
+
+//
+// A parsed request. The slices point into the read buffer and stay
+// valid until the reply has been written; only the filename (and CGI
+// arguments) are copied out, since stat() and open() need C strings.
+//
+typedef struct {
+    slice_t line;            // whole request line, without the line end
+    slice_t method, uri, version;
+    int keep_alive;          // client will send another request on it
+    size_t content_length;   // request body bytes to skip before the next one
+    unsigned long start;     // when its headers were taken up (stats_now)
+    slice_t range;           // header values, empty when absent
+    slice_t if_none_match;
+    slice_t if_modified_since;
+    int accept_gzip;         // Accept-Encoding allows gzip
+    char *filename;          // "./path", in path[]
+    char *cgiargs;           // query string, in path[] after filename
+    char path[REQUEST_PATH_MAX];
+} request_t;
+
+//
+// One piece of a reply: bytes in memory, or a run of the reply's file
+//
+typedef struct {
+    char *p;             // or NULL for body_fd
+    off_t off;           // offset in body_fd when p is NULL
+    size_t len;
+} response_part_t;
+
+//
+// A reply under construction or in flight: a list of parts, most of the
+// header ones constant strings. Runs of memory parts go out in one
+// sendmsg(), file parts with sendfile(), so a reply (even a multi-range
+// one) is never copied. 'sent' tracks progress so a non-blocking writer
+// can resume.
+//
+typedef struct {
+    response_part_t parts[RESPONSE_PARTS];
+    int count;
+    size_t len;          // bytes in all parts
+    char length[40];     // rendered per-reply headers
+    char range[96];
+    char etag[64];
+    char modified[64];
+    char *alloc;         // malloc'ed storage parts point into, or NULL
+    int body_fd;         // file the body runs come from, or -1
+    size_t sent;
+    int keep_alive;      // leave the connection open after this reply
+    struct cache_entry *entry; // if set, body parts point into it; held
+			       // until the reply is sent
+    int status;          // for the stats and access log
+    slice_t line;        // request line, for the access log
+    unsigned long start; // request's start, and first write (stats_now)
+    unsigned long send_start;
+} response_t;
+
+void request_handle(int fd, int *queued);
+int request_admit(void);
+void request_release(void);
+void request_accepted(int fd);
+void request_shed(int fd);
+int request_shed_overflow(int listen_fd, int *spare_fd);
+int request_peek_filename(int fd, request_t *req);
+void request_read_headers(rio_t *rio, request_t *req);
+int request_prepare(request_t *req, response_t *resp);
+void request_error(response_t *resp, char *cause, char *errnum, char *shortmsg, char *longmsg);
+pid_t request_start_dynamic(int fd, char *filename, char *cgiargs);
+
+void response_init(response_t *resp);
+int response_write(int fd, response_t *resp);
+void response_free(response_t *resp);
 
 #endif // __REQUEST_H__
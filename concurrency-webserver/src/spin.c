@@ -2,8 +2,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <sys/time.h>
 #include <unistd.h>
+#include "cgi.h"
 
 #define MAXBUF (8192)
 
@@ -11,6 +13,9 @@
 // This program is intended to help you test your web server.
 // You can use it to test that you are correctly having multiple threads
 // handling http requests.
+//
+// Run by wserver -f, it also serves as a reference persistent CGI
+// worker: see serve_persistent() below and the protocol in cgi.h.
 // 
 
 double get_seconds() {
@@ -20,12 +25,14 @@ double get_seconds() {
     return (double) ((double)t.tv_sec + (double)t.tv_usec / 1e6);
 }
 
-
-int main(int argc, char *argv[]) {
+//
+// Handles one request: the arguments are in QUERY_STRING and the rest
+// of the reply goes to stdout
+//
+void respond(char *buf) {
     // Extract arguments
     double spin_for = 0.0;
-    char *buf;
-    if ((buf = getenv("QUERY_STRING")) != NULL) {
+    if (buf != NULL) {
 	// just expecting a single number
 	spin_for = (double) atoi(buf);
     }
@@ -37,16 +44,84 @@ int main(int argc, char *argv[]) {
     
     /* Make the response body */
     char content[MAXBUF];
-    sprintf(content, "<p>Welcome to the CGI program (%s)</p>\r\n", buf);
-    sprintf(content, "%s<p>My only purpose is to waste time on the server!</p>\r\n", content);
-    sprintf(content, "%s<p>I spun for %.2f seconds</p>\r\n", content, t2 - t1);
+    int n = snprintf(content, MAXBUF, "<p>Welcome to the CGI program (%s)</p>\r\n", buf);
+    n += snprintf(content + n, MAXBUF - n, "<p>My only purpose is to waste time on the server!</p>\r\n");
+    snprintf(content + n, MAXBUF - n, "<p>I spun for %.2f seconds</p>\r\n", t2 - t1);
     
     /* Generate the HTTP response */
     printf("Content-length: %lu\r\n", strlen(content));
     printf("Content-type: text/html\r\n\r\n");
     printf("%s", content);
     fflush(stdout);
+}
+
+// read() exactly n bytes; 0 on EOF or error
+int read_all(int fd, void *buf, size_t n) {
+    char *p = buf;
+    while (n > 0) {
+	ssize_t rc = read(fd, p, n);
+	if (rc <= 0)
+	    return 0;
+	p += rc;
+	n -= rc;
+    }
+    return 1;
+}
+
+//
+// Persistent mode: say we are ready, then take requests off the control
+// socket until the server goes away. Each arrives as a frame carrying
+// QUERY_STRING, with the client's socket attached; point stdout at that
+// socket, answer exactly as a forked CGI would, then hand stdout back
+// (which closes the client's copy) and tell the server we are done.
+//
+void serve_persistent() {
+    int saved_stdout = dup(STDOUT_FILENO);
+    assert(saved_stdout >= 0);
+
+    cgi_frame_t ready = { .type = CGI_FRAME_READY, .len = 0 };
+    if (write(CGI_CONTROL_FD, &ready, sizeof(ready)) != sizeof(ready))
+	return;
     
-    exit(0);
+    while (1) {
+	cgi_frame_t frame;
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { .iov_base = &frame, .iov_len = sizeof(frame) };
+	struct msghdr msg = {
+	    .msg_iov = &iov, .msg_iovlen = 1,
+	    .msg_control = control, .msg_controllen = sizeof(control),
+	};
+	// the attached socket arrives with the first byte of the frame
+	ssize_t rc = recvmsg(CGI_CONTROL_FD, &msg, MSG_WAITALL);
+	if (rc != sizeof(frame) || frame.type != CGI_FRAME_REQUEST)
+	    break;
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS)
+	    break;
+	int client_fd;
+	memcpy(&client_fd, CMSG_DATA(cmsg), sizeof(int));
+	
+	char query[MAXBUF];
+	if (frame.len >= MAXBUF || !read_all(CGI_CONTROL_FD, query, frame.len))
+	    break;
+	query[frame.len] = '\0';
+	setenv("QUERY_STRING", query, 1);
+	
+	dup2(client_fd, STDOUT_FILENO);
+	close(client_fd);
+	respond(query);
+	dup2(saved_stdout, STDOUT_FILENO);
+	
+	cgi_frame_t done = { .type = CGI_FRAME_DONE, .len = 0 };
+	if (write(CGI_CONTROL_FD, &done, sizeof(done)) != sizeof(done))
+	    break;
+    }
 }
 
+int main(int argc, char *argv[]) {
+    if (getenv(CGI_PERSISTENT_ENV) != NULL)
+	serve_persistent();
+    else
+	respond(getenv("QUERY_STRING"));
+    exit(0);
+}
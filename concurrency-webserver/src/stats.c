@@ -0,0 +1,193 @@
+#include "io_helper.h"
+#include "stats.h"
+
+int stats_log_enabled = 0;
+
+static __thread stats_thread_t *self;
+static stats_thread_t *all_threads;   // push-only list, read without the lock
+static pthread_mutex_t register_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long started;
+static int log_fd = -1;
+
+// Single-writer update that a concurrent reader never sees torn
+#define STATS_ADD(field, n) __atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+
+// Monotonic time in microseconds
+unsigned long stats_now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (unsigned long) t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+// The calling thread's counters, created on its first request
+static stats_thread_t *stats_self() {
+    if (self)
+	return self;
+    stats_thread_t *t = malloc_or_die(sizeof(stats_thread_t));
+    memset(t, 0, sizeof(*t));
+    for (int i = 0; i < STATS_PHASES; i++)
+	hist_init(&t->phase[i]);
+    if (stats_log_enabled)
+	t->log = malloc_or_die(STATS_LOG_RING);
+    pthread_mutex_lock_or_die(&register_lock);
+    t->next = all_threads;
+    __atomic_store_n(&all_threads, t, __ATOMIC_RELEASE);
+    pthread_mutex_unlock_or_die(&register_lock);
+    self = t;
+    return t;
+}
+
+void stats_record(int phase, unsigned long usecs) {
+    hist_record(&stats_self()->phase[phase], usecs);
+}
+
+//
+// Appends a line to this thread's log ring for the logger thread to
+// write out. Never waits: if the logger has fallen that far behind,
+// the line is dropped and counted instead.
+//
+static void stats_log(stats_thread_t *t, char *line, size_t line_len, int status, size_t bytes,
+		      unsigned long usecs) {
+    char buf[STATS_LOG_LINE];
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    int n = snprintf(buf, STATS_LOG_LINE, "%ld.%03ld \"%.*s\" %d %zu %lu\n",
+		     (long) now.tv_sec, now.tv_nsec / 1000000,
+		     line ? (int) line_len : 1, line ? line : "-",
+		     status, bytes, usecs);
+    if (n >= STATS_LOG_LINE) {
+	n = STATS_LOG_LINE;
+	buf[n - 1] = '\n';
+    }
+    
+    unsigned long head = t->log_head;
+    unsigned long tail = __atomic_load_n(&t->log_tail, __ATOMIC_ACQUIRE);
+    if (head - tail + n > STATS_LOG_RING) {
+	STATS_ADD(t->log_dropped, 1);
+	return;
+    }
+    size_t off = head % STATS_LOG_RING;
+    size_t first = n < STATS_LOG_RING - off ? n : STATS_LOG_RING - off;
+    memcpy(t->log + off, buf, first);
+    memcpy(t->log, buf + first, n - first);
+    __atomic_store_n(&t->log_head, head + n, __ATOMIC_RELEASE);
+}
+
+//
+// Counts a finished request and logs it, with its request line (not
+// NUL-terminated). Status 0 marks one handed to a CGI program, whose
+// reply the server never sees.
+//
+void stats_request_done(char *line, size_t line_len, int status, size_t bytes, unsigned long start) {
+    stats_thread_t *t = stats_self();
+    unsigned long usecs = stats_now() - start;
+    STATS_ADD(t->requests, 1);
+    if (status == 0)
+	STATS_ADD(t->dynamic, 1);
+    else if (status / 100 < 6)
+	STATS_ADD(t->status[status / 100], 1);
+    STATS_ADD(t->bytes, bytes);
+    hist_record(&t->phase[STATS_TOTAL], usecs);
+    if (t->log)
+	stats_log(t, line, line_len, status, bytes, usecs);
+}
+
+static char *phase_names[STATS_PHASES] = { "queue_wait", "parse", "open", "send", "total" };
+
+//
+// Renders every thread's counters, summed, as plain text. Returns a
+// malloc'ed buffer of *len bytes.
+//
+char *stats_render(size_t *len) {
+    unsigned long requests = 0, dynamic = 0, bytes = 0, dropped = 0, status[6] = { 0 };
+    int threads = 0;
+    hist_t *phase = malloc_or_die(sizeof(hist_t) * STATS_PHASES);
+    for (int i = 0; i < STATS_PHASES; i++)
+	hist_init(&phase[i]);
+    
+    for (stats_thread_t *t = __atomic_load_n(&all_threads, __ATOMIC_ACQUIRE); t; t = t->next) {
+	threads++;
+	requests += __atomic_load_n(&t->requests, __ATOMIC_RELAXED);
+	dynamic += __atomic_load_n(&t->dynamic, __ATOMIC_RELAXED);
+	bytes += __atomic_load_n(&t->bytes, __ATOMIC_RELAXED);
+	dropped += __atomic_load_n(&t->log_dropped, __ATOMIC_RELAXED);
+	for (int i = 0; i < 6; i++)
+	    status[i] += __atomic_load_n(&t->status[i], __ATOMIC_RELAXED);
+	for (int i = 0; i < STATS_PHASES; i++)
+	    hist_merge(&phase[i], &t->phase[i]);
+    }
+    
+    char *buf;
+    FILE *fp = open_memstream(&buf, len);
+    assert(fp != NULL);
+    fprintf(fp, "uptime_s %.1f\nthreads %d\nrequests %lu\ndynamic %lu\n",
+	    (stats_now() - started) / 1e6, threads, requests, dynamic);
+    for (int i = 1; i < 6; i++)
+	fprintf(fp, "status_%dxx %lu\n", i, status[i]);
+    fprintf(fp, "bytes %lu\nlog_dropped %lu\n", bytes, dropped);
+    fprintf(fp, "# phase count mean_us p50_us p90_us p99_us p99.9_us max_us\n");
+    for (int i = 0; i < STATS_PHASES; i++) {
+	hist_t *h = &phase[i];
+	fprintf(fp, "%s %lu %.0f %lu %lu %lu %lu %lu\n", phase_names[i], h->total, hist_mean(h),
+		hist_percentile(h, 50.0), hist_percentile(h, 90.0), hist_percentile(h, 99.0),
+		hist_percentile(h, 99.9), h->max);
+    }
+    fclose(fp);
+    free(phase);
+    return buf;
+}
+
+static void write_all(int fd, char *buf, size_t n) {
+    while (n > 0) {
+	ssize_t rc = write(fd, buf, n);
+	if (rc < 0 && errno == EINTR)
+	    continue;
+	if (rc <= 0)
+	    return; // nowhere to put it; the log is best effort
+	buf += rc;
+	n -= rc;
+    }
+}
+
+//
+// Every STATS_LOG_FLUSH_MS, moves whatever each thread has logged to
+// the log file, one write per thread ring (two if it wrapped), so the
+// cost of the disk or terminal lands here and never on a worker
+//
+static void *stats_logger(void *arg) {
+    while (1) {
+	struct timespec pause = { 0, STATS_LOG_FLUSH_MS * 1000000L };
+	nanosleep(&pause, NULL);
+	for (stats_thread_t *t = __atomic_load_n(&all_threads, __ATOMIC_ACQUIRE); t; t = t->next) {
+	    unsigned long head = __atomic_load_n(&t->log_head, __ATOMIC_ACQUIRE);
+	    unsigned long tail = t->log_tail;
+	    if (head == tail)
+		continue;
+	    size_t off = tail % STATS_LOG_RING, n = head - tail;
+	    size_t first = n < STATS_LOG_RING - off ? n : STATS_LOG_RING - off;
+	    write_all(log_fd, t->log + off, first);
+	    write_all(log_fd, t->log, n - first);
+	    __atomic_store_n(&t->log_tail, head, __ATOMIC_RELEASE);
+	}
+    }
+    return NULL;
+}
+
+//
+// Starts the clock for uptime and, if log_path is set, the access log
+// ("-" for stdout). Must be called before any server thread handles a
+// request.
+//
+void stats_init(char *log_path) {
+    started = stats_now();
+    if (log_path == NULL)
+	return;
+    if (strcmp(log_path, "-") == 0)
+	log_fd = STDOUT_FILENO;
+    else
+	log_fd = open_or_die(log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    stats_log_enabled = 1;
+    pthread_t tid;
+    pthread_create_or_die(&tid, NULL, stats_logger, NULL);
+}
+
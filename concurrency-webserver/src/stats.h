@@ -0,0 +1,52 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stddef.h>
+#include "hist.h"
+
+// Reserved URI answered with the counters below instead of a file
+#define STATS_URI "/__stats"
+
+//
+// Request phases that get a latency histogram, in microseconds
+//
+#define STATS_QUEUE_WAIT (0)  // accepted until a worker takes it (pool engine)
+#define STATS_PARSE      (1)  // taking the request line and headers apart
+#define STATS_OPEN       (2)  // stat, cache lookup, and opening or loading the file
+#define STATS_SEND       (3)  // first write until the whole reply is out
+#define STATS_TOTAL      (4)  // headers in until the whole reply is out
+#define STATS_PHASES     (5)
+
+// Access log: bytes buffered per thread, and how often they are written out
+#define STATS_LOG_RING     (1 << 18)
+#define STATS_LOG_LINE     (1024)
+#define STATS_LOG_FLUSH_MS (50)
+
+//
+// Counters owned by one server thread. Only that thread writes them, so
+// updates need no locks or atomic read-modify-writes; the /__stats
+// renderer reads them from other threads and may see a request that is
+// half counted, which is fine for monitoring.
+//
+typedef struct stats_thread {
+    unsigned long requests;
+    unsigned long dynamic;       // handed off to a CGI program
+    unsigned long status[6];     // by class: status[2] counts 2xx, etc.
+    unsigned long bytes;
+    hist_t phase[STATS_PHASES];
+    char *log;                   // access log ring (STATS_LOG_RING bytes)
+    unsigned long log_head;      // written by this thread
+    unsigned long log_tail;      // written by the logger thread
+    unsigned long log_dropped;   // lines lost to a full ring
+    struct stats_thread *next;
+} stats_thread_t;
+
+extern int stats_log_enabled;
+
+unsigned long stats_now();
+void stats_record(int phase, unsigned long usecs);
+void stats_request_done(char *line, size_t line_len, int status, size_t bytes, unsigned long start);
+char *stats_render(size_t *len);
+void stats_init(char *log_path);
+
+#endif // __STATS_H__
@@ -34,7 +34,9 @@ void client_send(int fd, char *filename) {
     
     /* Form and send the HTTP request */
     sprintf(buf, "GET %s HTTP/1.1\n", filename);
-    sprintf(buf, "%shost: %s\n\r\n", buf, hostname);
+    snprintf(buf + strlen(buf), MAXBUF - strlen(buf), "host: %s\n", hostname);
+    // one request per connection; read the reply until the server closes
+    strcat(buf, "Connection: close\n\r\n");
     write_or_die(fd, buf, strlen(buf));
 }
 
@@ -42,27 +44,30 @@ void client_send(int fd, char *filename) {
 // Read the HTTP response and print it out
 //
 void client_print(int fd) {
-    char buf[MAXBUF];  
-    int n;
+    rio_t rio;
+    char *line;
+    ssize_t n;
+    
+    rio_init(&rio, fd);
     
     // Read and display the HTTP Header 
-    n = readline_or_die(fd, buf, MAXBUF);
-    while (strcmp(buf, "\r\n") && (n > 0)) {
-	printf("Header: %s", buf);
-	n = readline_or_die(fd, buf, MAXBUF);
+    n = rio_readline_or_die(&rio, &line);
+    while (n > 0 && strncmp(line, "\r\n", n)) {
+	printf("Header: %.*s", (int) n, line);
+	n = rio_readline_or_die(&rio, &line);
 	
 	// If you want to look for certain HTTP tags... 
 	// int length = 0;
-	//if (sscanf(buf, "Content-Length: %d ", &length) == 1) {
+	//if (sscanf(line, "Content-Length: %d ", &length) == 1) {
 	//    printf("Length = %d\n", length);
 	//}
     }
     
     // Read and display the HTTP Body 
-    n = readline_or_die(fd, buf, MAXBUF);
+    n = rio_readline_or_die(&rio, &line);
     while (n > 0) {
-	printf("%s", buf);
-	n = readline_or_die(fd, buf, MAXBUF);
+	fwrite(line, 1, n, stdout);
+	n = rio_readline_or_die(&rio, &line);
     }
 }
 
@@ -0,0 +1,434 @@
+//
+// wload.c: a load generator for the web server.
+//
+// To run, try:
+//      wload [-t threads] [-d seconds] [-r rate] [-k] [-u urifile] [-T tracefile]
+//            [-o timeout] [-J file] hostname portnumber [uri ...]
+//
+// Each of the threads drives one connection. By default the load is
+// closed-loop: a thread sends its next request as soon as the previous
+// reply is in. With -r, the load is open-loop at a fixed total rate;
+// requests are scheduled on a fixed timetable and latency is measured
+// from when a request was *supposed* to go out, so a stalled server
+// cannot hide its stalls by slowing the client down (coordinated
+// omission).
+//
+// URIs come from the command line, or from a file with one
+// "[weight] uri" per line; each request picks one at random, in
+// proportion to the weights. With -T, a recorded trace is replayed
+// instead: its requests are sent once, in order, shared out among the
+// threads, and the run ends when the trace does (or the time is up). A
+// trace has one request per line, either a bare URI or a line of the
+// server's access log (wserver -l). With -k, connections are kept
+// alive across requests.
+//
+// A connect, or a wait for the next bytes of a reply, that takes longer
+// than the -o timeout (in seconds; 0 for none) fails the request: it
+// counts as an error, and as a timeout, and the connection is dropped.
+// A stalled server thus shows up in the report rather than hanging it.
+//
+// At the end it prints throughput and a latency histogram summary, and
+// with -J writes the same as JSON ("-" for stdout).
+//
+
+#include "io_helper.h"
+#include "hist.h"
+
+#define MAXBUF (8192)
+#define RETRY_SECS (0.01)   // pause after a failed connect
+#define TIMEOUT_SECS (10.0) // default for -o
+
+typedef struct {
+    char *uri;
+    double cumulative;   // running total of weights, for picking
+} uri_t;
+
+uri_t *uris;
+int num_uris;
+double total_weight;
+
+char **trace;        // -T: URIs in order
+long trace_len;
+long trace_next;     // next one to send, shared by the threads
+
+char *host;
+int port;
+struct sockaddr_storage server_addr;   // host and port, resolved once
+socklen_t server_addr_len;
+int keep_alive = 0;
+double timeout = TIMEOUT_SECS;   // per connect or read; 0 means none
+double rate = 0.0;   // requests/sec over all threads; 0 means closed-loop
+int threads = 1;
+volatile int done = 0;
+int finished = 0;    // threads that ran out of trace
+
+typedef struct {
+    pthread_t tid;
+    int id;
+    unsigned int seed;
+    unsigned long requests;
+    unsigned long errors;
+    unsigned long timeouts;   // errors where the server took too long
+    unsigned long non_2xx;
+    unsigned long connects;
+    unsigned long bytes;
+    hist_t latency;   // microseconds
+} load_thread_t;
+
+double now_seconds() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double) t.tv_sec + (double) t.tv_nsec / 1e9;
+}
+
+void sleep_until(double when) {
+    struct timespec t;
+    t.tv_sec = (time_t) when;
+    t.tv_nsec = (long) ((when - t.tv_sec) * 1e9);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL) == EINTR)
+	;
+}
+
+void add_uri(char *uri, double weight) {
+    uris = realloc(uris, sizeof(uri_t) * (num_uris + 1));
+    assert(uris != NULL);
+    total_weight += weight;
+    uris[num_uris].uri = strdup(uri);
+    uris[num_uris].cumulative = total_weight;
+    num_uris++;
+}
+
+void load_uri_file(char *filename) {
+    FILE *fp = fopen(filename, "r");
+    if (fp == NULL) {
+	perror(filename);
+	exit(1);
+    }
+    char line[MAXBUF], a[MAXBUF], b[MAXBUF];
+    while (fgets(line, MAXBUF, fp) != NULL) {
+	int n = sscanf(line, "%s %s", a, b);
+	if (n <= 0 || a[0] == '#')
+	    continue;
+	if (n == 1)
+	    add_uri(a, 1.0);
+	else if (atof(a) > 0)
+	    add_uri(b, atof(a));
+    }
+    fclose(fp);
+}
+
+char *pick_uri(load_thread_t *t) {
+    double r = (double) rand_r(&t->seed) / ((double) RAND_MAX + 1.0) * total_weight;
+    int lo = 0, hi = num_uris - 1;
+    while (lo < hi) {
+	int mid = (lo + hi) / 2;
+	if (uris[mid].cumulative > r)
+	    hi = mid;
+	else
+	    lo = mid + 1;
+    }
+    return uris[lo].uri;
+}
+
+//
+// Reads a trace: the URI on each line is its first word starting with
+// '/', which covers both bare URIs and access log lines
+//
+void load_trace_file(char *filename) {
+    FILE *fp = fopen(filename, "r");
+    if (fp == NULL) {
+	perror(filename);
+	exit(1);
+    }
+    char line[MAXBUF];
+    long room = 0;
+    while (fgets(line, MAXBUF, fp) != NULL) {
+	char *word = strtok(line, " \t\r\n\"");
+	while (word && word[0] != '/')
+	    word = strtok(NULL, " \t\r\n\"");
+	if (word == NULL)
+	    continue;
+	if (trace_len == room) {
+	    room = room ? room * 2 : 1024;
+	    trace = realloc(trace, sizeof(char *) * room);
+	    assert(trace != NULL);
+	}
+	trace[trace_len++] = strdup(word);
+    }
+    fclose(fp);
+}
+
+// The URI to request next, or NULL once a trace has been used up
+char *next_uri(load_thread_t *t) {
+    if (trace == NULL)
+	return pick_uri(t);
+    long i = __atomic_fetch_add(&trace_next, 1, __ATOMIC_RELAXED);
+    return i < trace_len ? trace[i] : NULL;
+}
+
+//
+// Resolves host and port into server_addr, once, before the threads
+// start (gethostbyname is not safe to call from all of them at once)
+//
+void resolve_server() {
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *res;
+    char service[16];
+    snprintf(service, sizeof(service), "%d", port);
+    int rc = getaddrinfo(host, service, &hints, &res);
+    if (rc != 0) {
+	fprintf(stderr, "wload: %s: %s\n", host, gai_strerror(rc));
+	exit(1);
+    }
+    memcpy(&server_addr, res->ai_addr, res->ai_addrlen);
+    server_addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+}
+
+// Returns a socket connected to the server, or -1 (nothing left open);
+// on it, a connect, read or write that waits past timeout fails with
+// EAGAIN (EINPROGRESS for the connect)
+int connect_server() {
+    int fd = socket(server_addr.ss_family, SOCK_STREAM, 0);
+    if (fd < 0)
+	return -1;
+    if (timeout > 0) {
+	struct timeval tv = { .tv_sec = (time_t) timeout,
+			      .tv_usec = (suseconds_t) ((timeout - (time_t) timeout) * 1e6) };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    }
+    if (connect(fd, (sockaddr_t *) &server_addr, server_addr_len) < 0) {
+	close(fd);
+	return -1;
+    }
+    return fd;
+}
+
+//
+// Sends one request and reads the whole reply. Returns 1 if the
+// connection can take another request, 0 if it has to be reopened,
+// -1 on error (with errno EAGAIN if the server took too long).
+//
+int do_request(load_thread_t *t, int fd, rio_t *rio, char *uri) {
+    char buf[MAXBUF];
+    int n = snprintf(buf, MAXBUF, "GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n",
+		     uri, host, keep_alive ? "" : "Connection: close\r\n");
+    for (int sent = 0; sent < n; ) {
+	ssize_t rc = write(fd, buf + sent, n - sent);
+	if (rc < 0)
+	    return -1;
+	sent += rc;
+    }
+    
+    if (rio_fill_headers(rio) <= 0)
+	return -1;
+    
+    char *line;
+    ssize_t len = rio_readline(rio, &line);
+    int status = 0, reusable = keep_alive;
+    sscanf(line, "%*s %d", &status);
+    if (status < 200 || status > 299)
+	t->non_2xx++;
+    
+    size_t content_length = (size_t) -1;
+    while ((len = rio_readline(rio, &line)) > 0 && line[0] != '\n' && strncmp(line, "\r\n", 2)) {
+	if (strncasecmp(line, "Content-Length:", 15) == 0)
+	    content_length = strtoul(line + 15, NULL, 10);
+	else if (strncasecmp(line, "Connection:", 11) == 0 && strcasestr(line + 11, "close"))
+	    reusable = 0;
+    }
+    
+    // without a length (e.g. CGI replies), the body runs to EOF
+    if (content_length == (size_t) -1)
+	reusable = 0;
+    size_t remaining = content_length;
+    size_t before = remaining;
+    int rc = rio_discard(rio, &remaining);
+    t->bytes += before - remaining;
+    if (rc < 0 || (rc == 0 && content_length != (size_t) -1))
+	return -1;
+    return reusable;
+}
+
+void *load_thread(void *arg) {
+    load_thread_t *t = arg;
+    rio_t *rio = malloc_or_die(sizeof(rio_t));
+    int fd = -1;
+    double interval = rate > 0 ? threads / rate : 0.0;
+    // stagger open-loop threads so their timetables interleave
+    double next = now_seconds() + interval * t->id / threads;
+    
+    while (!done) {
+	double start;
+	if (rate > 0) {
+	    sleep_until(next);
+	    start = next;   // latency counts from the scheduled time
+	    next += interval;
+	} else {
+	    start = now_seconds();
+	}
+	char *uri = next_uri(t);
+	if (done || uri == NULL)
+	    break;
+	
+	if (fd < 0) {
+	    fd = connect_server();
+	    if (fd < 0) {
+		// a refused or failing server must not be hammered in a loop
+		t->errors++;
+		if (errno == EINPROGRESS)
+		    t->timeouts++;
+		sleep_until(now_seconds() + RETRY_SECS);
+		continue;
+	    }
+	    t->connects++;
+	    rio_init(rio, fd);
+	}
+	
+	errno = 0; // EOF leaves it alone
+	int rc = do_request(t, fd, rio, uri);
+	if (rc < 0) {
+	    t->errors++;
+	    if (errno == EAGAIN || errno == EWOULDBLOCK)
+		t->timeouts++;
+	} else {
+	    t->requests++;
+	    hist_record(&t->latency, (unsigned long) ((now_seconds() - start) * 1e6));
+	}
+	if (rc <= 0) {
+	    close(fd);
+	    fd = -1;
+	}
+    }
+    if (fd >= 0)
+	close(fd);
+    free(rio);
+    __atomic_fetch_add(&finished, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static double percentiles[] = { 50.0, 90.0, 99.0, 99.9 };
+#define NUM_PERCENTILES (sizeof(percentiles) / sizeof(percentiles[0]))
+
+void report_text(load_thread_t *total, double elapsed) {
+    hist_t *h = &total->latency;
+    printf("%s load, %d threads, %.1f s%s\n", rate > 0 ? "open-loop" : "closed-loop",
+	   threads, elapsed, keep_alive ? ", keep-alive" : "");
+    printf("requests:   %lu (%.1f/s)\n", total->requests, total->requests / elapsed);
+    printf("errors:     %lu (timeouts: %lu)  non-2xx: %lu  connects: %lu\n",
+	   total->errors, total->timeouts, total->non_2xx, total->connects);
+    printf("body bytes: %lu (%.2f MB/s)\n", total->bytes, total->bytes / elapsed / 1e6);
+    printf("latency (us): mean %.0f", hist_mean(h));
+    for (int i = 0; i < NUM_PERCENTILES; i++)
+	printf("  p%g %lu", percentiles[i], hist_percentile(h, percentiles[i]));
+    printf("  max %lu\n", h->max);
+}
+
+void report_json(FILE *fp, load_thread_t *total, double elapsed) {
+    hist_t *h = &total->latency;
+    fprintf(fp, "{\"mode\": \"%s\", \"threads\": %d, \"rate\": %.1f, \"keep_alive\": %s, "
+	    "\"seconds\": %.3f, \"requests\": %lu, \"throughput\": %.1f, \"errors\": %lu, "
+	    "\"timeouts\": %lu, \"non_2xx\": %lu, \"connects\": %lu, \"bytes\": %lu, \"latency_us\": {\"mean\": %.1f",
+	    rate > 0 ? "open" : "closed", threads, rate, keep_alive ? "true" : "false",
+	    elapsed, total->requests, total->requests / elapsed, total->errors,
+	    total->timeouts, total->non_2xx, total->connects, total->bytes, hist_mean(h));
+    for (int i = 0; i < NUM_PERCENTILES; i++)
+	fprintf(fp, ", \"p%g\": %lu", percentiles[i], hist_percentile(h, percentiles[i]));
+    fprintf(fp, ", \"max\": %lu}}\n", h->max);
+}
+
+void usage() {
+    fprintf(stderr, "usage: wload [-t threads] [-d seconds] [-r rate] [-k] [-u urifile] [-T tracefile]\n"
+	    "             [-o timeout] [-J file] host port [uri ...]\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    int c;
+    double duration = 10.0;
+    char *json = NULL;
+    
+    while ((c = getopt(argc, argv, "t:d:r:ku:T:o:J:")) != -1)
+	switch (c) {
+	case 't':
+	    threads = atoi(optarg);
+	    break;
+	case 'd':
+	    duration = atof(optarg);
+	    break;
+	case 'r':
+	    rate = atof(optarg);
+	    break;
+	case 'k':
+	    keep_alive = 1;
+	    break;
+	case 'u':
+	    load_uri_file(optarg);
+	    break;
+	case 'T':
+	    load_trace_file(optarg);
+	    break;
+	case 'o':
+	    timeout = atof(optarg);
+	    break;
+	case 'J':
+	    json = optarg;
+	    break;
+	default:
+	    usage();
+	}
+    if (argc - optind < 2 || threads <= 0 || duration <= 0 || rate < 0 || timeout < 0)
+	usage();
+    host = argv[optind];
+    port = atoi(argv[optind + 1]);
+    for (int i = optind + 2; i < argc; i++)
+	add_uri(argv[i], 1.0);
+    if (num_uris == 0)
+	add_uri("/", 1.0);
+    resolve_server();
+    
+    // a server closing on us must show up as an error, not kill us
+    signal(SIGPIPE, SIG_IGN);
+    
+    load_thread_t *ts = calloc(threads, sizeof(load_thread_t));
+    assert(ts != NULL);
+    double start = now_seconds();
+    for (int i = 0; i < threads; i++) {
+	ts[i].id = i;
+	ts[i].seed = (unsigned int) (start * 1e6) + i;
+	hist_init(&ts[i].latency);
+	pthread_create_or_die(&ts[i].tid, NULL, load_thread, &ts[i]);
+    }
+    // until the time is up, or every thread has run out of trace
+    while (now_seconds() < start + duration && __atomic_load_n(&finished, __ATOMIC_ACQUIRE) < threads)
+	sleep_until(now_seconds() + 0.01);
+    done = 1;
+    
+    load_thread_t *total = calloc(1, sizeof(load_thread_t));
+    assert(total != NULL);
+    hist_init(&total->latency);
+    for (int i = 0; i < threads; i++) {
+	pthread_join(ts[i].tid, NULL);
+	total->requests += ts[i].requests;
+	total->errors += ts[i].errors;
+	total->timeouts += ts[i].timeouts;
+	total->non_2xx += ts[i].non_2xx;
+	total->connects += ts[i].connects;
+	total->bytes += ts[i].bytes;
+	hist_merge(&total->latency, &ts[i].latency);
+    }
+    double elapsed = now_seconds() - start;
+    
+    report_text(total, elapsed);
+    if (json) {
+	FILE *fp = strcmp(json, "-") ? fopen(json, "w") : stdout;
+	if (fp == NULL) {
+	    perror(json);
+	    exit(1);
+	}
+	report_json(fp, total, elapsed);
+	if (fp != stdout)
+	    fclose(fp);
+    }
+    exit(0);
+}
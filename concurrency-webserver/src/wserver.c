@@ -1,18 +1,264 @@
 #include <stdio.h>
 #include "request.h"
 #include "io_helper.h"
+#include "buffer.h"
+#include "event.h"
+#include "cache.h"
+#include "cgi.h"
+#include "stats.h"
 
 char default_root[] = ".";
 
+// Under SFF and SFNF, how long an accepted connection may go without
+// its request line before it is queued anyway, with the worst key
+#define PEEK_WAIT_MS (20)
+
+#define PENDING_BATCH (64)
+
+// a connection waiting for its request line, so it can be scheduled
+typedef struct pending {
+    int fd;
+    unsigned long since;            // when it was accepted (stats_now)
+    struct pending *prev, *next;    // acceptance order
+} pending_t;
+
+//
+// A listener with the threads serving it. Normally there is one; with
+// -r there is one per CPU, each with its own SO_REUSEPORT listener,
+// buffer and threads, all pinned to that CPU, so shards share no locks
+// and a connection stays on the core that accepted it.
+//
+typedef struct {
+    int cpu;                 // or -1 if not pinned
+    int listen_fd;
+    buffer_t buffer;         // pool engine only
+    int epfd;                // pool acceptor: the listener and pending ones
+    pending_t *oldest, *newest;
+} shard_t;
+
+shard_t *shards;
+int num_shards = 1;
+
+// settings every shard is started with
+int port = 10000;
+int threads = 1;
+int buffers = 1;
+int policy = SCHED_FIFO_POLICY;
+char *engine = "pool";
+int backlog = 1024;
+
+//
+// Each worker pulls an accepted connection off its shard's buffer,
+// handles it, and goes back for another
+//
+void *worker(void *arg) {
+    buffer_t *b = arg;
+    while (1) {
+	int conn_fd = buffer_get(b);
+	request_handle(conn_fd, &b->count);
+	close_or_warn(conn_fd);
+	request_release();
+    }
+    return NULL;
+}
+
+//
+// Compute the key a new connection is queued under in its shard's
+// buffer; each shard's acceptor calls this for the connections it
+// accepts, before any worker reads them. Returns -1, without waiting,
+// if the request line is not all there yet. Requests that are unusable
+// or cannot be stat'ed get key 0: they end up as cheap error responses,
+// so serving them early costs little.
+//
+long schedule_key(int conn_fd, int policy) {
+    request_t req;
+    struct stat sbuf;
+
+    if (policy == SCHED_FIFO_POLICY)
+	return 0;
+    int rc = request_peek_filename(conn_fd, &req);
+    if (rc == -1)
+	return -1;
+    if (rc < 0)
+	return 0;
+    if (policy == SCHED_SFNF_POLICY)
+	return strlen(req.filename);
+    if (stat(req.filename, &sbuf) < 0)
+	return 0;
+    return sbuf.st_size;
+}
+
+//
+// SIGUSR1 dumps the scheduling and cache counters to stderr. The signal
+// is blocked everywhere else and picked up here, so no locks are taken
+// from signal context.
+//
+void *stats_dumper(void *arg) {
+    sigset_t *set = arg;
+    while (1) {
+	int sig;
+	if (sigwait(set, &sig) != 0)
+	    continue;
+	for (int i = 0; i < num_shards; i++)
+	    if (shards[i].buffer.size > 0) { // pool engine only
+		if (num_shards > 1)
+		    fprintf(stderr, "shard %d: ", i);
+		buffer_print_stats(&shards[i].buffer, stderr);
+	    }
+	if (cache_enabled)
+	    cache_print_stats(stderr);
+    }
+    return NULL;
+}
+
+//
+// Queues conn_fd on s's buffer if its key can be had now; otherwise
+// holds it until more of its request arrives. It is only watched for
+// new bytes (edge-triggered), since those already peeked at stay
+// readable.
+//
+static void shard_enqueue(shard_t *s, int conn_fd) {
+    long key = schedule_key(conn_fd, policy);
+    if (key >= 0) {
+	buffer_put(&s->buffer, conn_fd, key);
+	return;
+    }
+    pending_t *p = malloc_or_die(sizeof(pending_t));
+    p->fd = conn_fd;
+    p->since = stats_now();
+    p->prev = s->newest;
+    p->next = NULL;
+    if (s->newest)
+	s->newest->next = p;
+    else
+	s->oldest = p;
+    s->newest = p;
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | EPOLLET, .data.ptr = p };
+    epoll_ctl_or_die(s->epfd, EPOLL_CTL_ADD, conn_fd, &ev);
+}
+
+// Stops holding p, and queues its connection under key
+static void pending_put(shard_t *s, pending_t *p, long key) {
+    if (p->prev)
+	p->prev->next = p->next;
+    else
+	s->oldest = p->next;
+    if (p->next)
+	p->next->prev = p->prev;
+    else
+	s->newest = p->prev;
+    epoll_ctl(s->epfd, EPOLL_CTL_DEL, p->fd, NULL);
+    buffer_put(&s->buffer, p->fd, key);
+    free(p);
+}
+
+// Takes every connection waiting on s's (non-blocking) listener
+static void shard_accept(shard_t *s, int *spare_fd) {
+    while (1) {
+	int conn_fd = accept4(s->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	if (conn_fd < 0) {
+	    if (errno == EINTR || errno == ECONNABORTED)
+		continue;
+	    if (errno == EMFILE || errno == ENFILE) {
+		if (request_shed_overflow(s->listen_fd, spare_fd) == 0)
+		    continue;
+		struct timespec pause = { 0, REQUEST_SHED_BACKOFF_MS * 1000000L };
+		nanosleep(&pause, NULL);
+	    } else if (errno != EAGAIN && errno != EWOULDBLOCK)
+		perror("accept4");
+	    return;
+	}
+	if (!request_admit()) {
+	    request_shed(conn_fd);
+	    continue;
+	}
+	request_accepted(conn_fd);
+	shard_enqueue(s, conn_fd);
+    }
+}
+
+//
+// Runs one shard, on the calling thread: pins it (threads created from
+// here inherit the CPU mask), then either becomes the event loops or
+// starts the worker pool and becomes its acceptor. Does not return.
+//
+void *shard_run(void *arg) {
+    shard_t *s = arg;
+    if (s->cpu >= 0) {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(s->cpu, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+    s->listen_fd = open_listen_fd_or_die(port, num_shards > 1, backlog);
+
+    if (strcmp(engine, "epoll") == 0) {
+	event_run(s->listen_fd, threads);
+	return NULL;
+    }
+
+    // start the pool of workers before any connections show up
+    buffer_init(&s->buffer, buffers, policy);
+    for (int i = 0; i < threads; i++) {
+	pthread_t tid;
+	pthread_create_or_die(&tid, NULL, worker, &s->buffer);
+    }
+
+    // now, get to work: this thread only accepts and enqueues. Clients
+    // still sending their request line are held in the epoll set rather
+    // than waited for, so none of them holds up the others.
+    int spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    int flags = fcntl(s->listen_fd, F_GETFL);
+    fcntl(s->listen_fd, F_SETFL, flags | O_NONBLOCK);
+    s->epfd = epoll_create1_or_die(EPOLL_CLOEXEC);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    epoll_ctl_or_die(s->epfd, EPOLL_CTL_ADD, s->listen_fd, &ev);
+    struct epoll_event events[PENDING_BATCH];
+    while (1) {
+	int timeout = -1;
+	if (s->oldest) {
+	    unsigned long waited = (stats_now() - s->oldest->since) / 1000;
+	    timeout = waited < PEEK_WAIT_MS ? PEEK_WAIT_MS - waited : 0;
+	}
+	int n = epoll_wait(s->epfd, events, PENDING_BATCH, timeout);
+	for (int i = 0; i < n; i++) {
+	    pending_t *p = events[i].data.ptr;
+	    if (p == NULL) {
+		shard_accept(s, &spare_fd);
+		continue;
+	    }
+	    long key = schedule_key(p->fd, policy);
+	    if (key >= 0)
+		pending_put(s, p, key);
+	}
+	// a client that is slow to send its request line goes last, so it
+	// cannot jump the queue by being slow; aging still serves it
+	while (s->oldest && stats_now() - s->oldest->since >= PEEK_WAIT_MS * 1000UL)
+	    pending_put(s, s->oldest, LONG_MAX);
+    }
+    return NULL;
+}
+
+//
+// ./wserver [-d <basedir>] [-p <portnum>] [-t <threads>] [-b <buffers>] [-s <schedalg>]
+//           [-e pool|epoll] [-k <max-requests>] [-i <idle-secs>] [-c <cache-MB>]
+//           [-f <cgi-workers>] [-l <access-log>] [-r] [-m <max-in-flight>] [-q <backlog>]
+//           [-R <read-secs>] [-W <write-secs>]
+//
+// With -e epoll, -t sets the number of event loops and -b/-s do not apply.
+// With -r, every CPU gets a shard with that many threads (and buffers).
+// -m limits the connections held across all shards; past it, new ones
+// get an immediate 503.
 //
-// ./wserver [-d <basedir>] [-p <portnum>] 
-// 
 int main(int argc, char *argv[]) {
     int c;
     char *root_dir = default_root;
-    int port = 10000;
+    int sharded = 0;
+    int cache_mb = 0;
+    int cgi_per_program = 0;
+    char *access_log = NULL;
     
-    while ((c = getopt(argc, argv, "d:p:")) != -1)
+    while ((c = getopt(argc, argv, "d:p:t:b:s:e:k:i:c:f:l:rm:q:R:W:")) != -1)
 	switch (c) {
 	case 'd':
 	    root_dir = optarg;
@@ -20,28 +266,118 @@ int main(int argc, char *argv[]) {
 	case 'p':
 	    port = atoi(optarg);
 	    break;
+	case 't':
+	    threads = atoi(optarg);
+	    break;
+	case 'b':
+	    buffers = atoi(optarg);
+	    break;
+	case 's':
+	    if ((policy = buffer_parse_policy(optarg)) < 0) {
+		fprintf(stderr, "wserver: schedalg must be one of FIFO, SFF or SFNF\n");
+		exit(1);
+	    }
+	    break;
+	case 'e':
+	    engine = optarg;
+	    if (strcmp(engine, "pool") && strcmp(engine, "epoll")) {
+		fprintf(stderr, "wserver: engine must be pool or epoll\n");
+		exit(1);
+	    }
+	    break;
+	case 'k':
+	    request_keepalive_max = atoi(optarg);
+	    break;
+	case 'i':
+	    request_idle_secs = atoi(optarg);
+	    break;
+	case 'c':
+	    cache_mb = atoi(optarg);
+	    break;
+	case 'f':
+	    cgi_per_program = atoi(optarg);
+	    break;
+	case 'l':
+	    access_log = optarg;
+	    break;
+	case 'r':
+	    sharded = 1;
+	    break;
+	case 'm':
+	    request_max_in_flight = atoi(optarg);
+	    break;
+	case 'q':
+	    backlog = atoi(optarg);
+	    break;
+	case 'R':
+	    request_read_secs = atoi(optarg);
+	    break;
+	case 'W':
+	    request_write_secs = atoi(optarg);
+	    break;
 	default:
-	    fprintf(stderr, "usage: wserver [-d basedir] [-p port]\n");
+	    fprintf(stderr, "usage: wserver [-d basedir] [-p port] [-t threads] [-b buffers] [-s schedalg] [-e engine]\n"
+		    "               [-k max-requests] [-i idle-secs] [-c cache-MB] [-f cgi-workers]\n"
+		    "               [-l access-log] [-r] [-m max-in-flight] [-q backlog]\n"
+		    "               [-R read-secs] [-W write-secs]\n");
 	    exit(1);
 	}
 
+    if (threads <= 0 || buffers <= 0 || request_keepalive_max <= 0 || request_idle_secs <= 0 || cache_mb < 0 || cgi_per_program < 0) {
+	fprintf(stderr, "wserver: threads, buffers, max-requests and idle-secs must be positive integers\n");
+	exit(1);
+    }
+    if (request_max_in_flight < 0 || backlog <= 0 || request_read_secs < 0 || request_write_secs < 0) {
+	fprintf(stderr, "wserver: backlog must be positive; max-in-flight, read-secs and write-secs "
+		"must not be negative (0: no limit)\n");
+	exit(1);
+    }
+
+    // a client hanging up must not kill the server mid-write
+    signal(SIGPIPE, SIG_IGN);
+
+    // open the log relative to where we were started, then
     // run out of this directory
+    stats_init(access_log);
     chdir_or_die(root_dir);
 
-    // now, get to work
-    int listen_fd = open_listen_fd_or_die(port);
-    while (1) {
-	struct sockaddr_in client_addr;
-	int client_len = sizeof(client_addr);
-	int conn_fd = accept_or_die(listen_fd, (sockaddr_t *) &client_addr, (socklen_t *) &client_len);
-	request_handle(conn_fd);
-	close_or_die(conn_fd);
-    }
-    return 0;
-}
+    if (cache_mb > 0)
+	cache_init((size_t) cache_mb << 20);
 
+    // one shard per CPU we may run on, or a single unpinned one; set up
+    // before stats_dumper starts, since a SIGUSR1 makes it walk them
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    if (sharded && sched_getaffinity(0, sizeof(cpus), &cpus) < 0) {
+	perror("sched_getaffinity");
+	sharded = 0;
+    }
+    if (sharded)
+	num_shards = CPU_COUNT(&cpus);
+    shards = malloc_or_die(sizeof(shard_t) * num_shards);
+    memset(shards, 0, sizeof(shard_t) * num_shards);
+    for (int i = 0, cpu = 0; i < num_shards; i++, cpu++) {
+	while (sharded && !CPU_ISSET(cpu, &cpus))
+	    cpu++;
+	shards[i].cpu = sharded ? cpu : -1;
+    }
 
-    
+    // threads created below inherit this mask; only stats_dumper takes SIGUSR1
+    sigset_t stats_set;
+    sigemptyset(&stats_set);
+    sigaddset(&stats_set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &stats_set, NULL);
+    pthread_t stats_tid;
+    pthread_create_or_die(&stats_tid, NULL, stats_dumper, &stats_set);
 
+    if (cgi_per_program > 0)
+	cgi_init(cgi_per_program);
 
- 
+    // the main thread runs shard 0, so start the others first
+    for (int i = 1; i < num_shards; i++) {
+	pthread_t tid;
+	pthread_create_or_die(&tid, NULL, shard_run, &shards[i]);
+    }
+    shard_run(&shards[0]);
+    return 0;
+}
@@ -0,0 +1,318 @@
+#define _GNU_SOURCE  // memmem, memrchr
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysinfo.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define CHUNK_SIZE (4 << 20)    // bytes of a file searched as one piece of work
+#define READ_SIZE (4 << 20)     // bytes read at a time from standard input
+#define LONG_TERM 32            // longer terms are left to memmem's Two-Way
+
+// Matching lines found in a chunk, as ranges of the mapped file (lines
+// next to each other are merged into one range)
+typedef struct {
+	struct iovec *lines;
+	int nlines, cap;
+} matches_t;
+
+// A piece of one input, starting at a line start and ending after a line end
+typedef struct {
+	const char *p;
+	size_t len;
+	matches_t found;
+	bool done;
+} chunk_t;
+
+const char *map_file(const char *, size_t *);
+void add_chunks(const char *, size_t);
+void *search_chunks(void *);
+void grep_buffer(const char *, size_t, matches_t *);
+const char *find(const char *, size_t);
+void add_line(matches_t *, const char *, size_t);
+void grep_stdin(void);
+void write_lines(matches_t *);
+void usage(void);
+
+const char *term;
+size_t term_len;
+
+chunk_t *chunks = NULL;
+size_t nchunks = 0, chunks_cap = 0;
+
+// next chunk to hand out; the main thread writes them out in order
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t chunk_done = PTHREAD_COND_INITIALIZER;
+size_t next_chunk = 0;
+
+
+int main(int argc, char *argv[]) {
+	if (argc < 2) usage();
+	term = argv[1];
+	term_len = strlen(term);
+
+	if (argc == 2) {
+		grep_stdin();
+		return 0;
+	}
+
+	// map every file up front; files before one that cannot be opened
+	// are still searched, as they would be one at a time
+	bool cannot_open = false;
+	for (int i = 2; i < argc; ++i) {
+		size_t len;
+		const char *data = map_file(argv[i], &len);
+		if (data == NULL) {
+			cannot_open = true;
+			break;
+		}
+		add_chunks(data, len);
+	}
+
+	// threads take the next chunk whenever they are free, and this
+	// thread writes out what each found, in order
+	int nthreads = get_nprocs();
+	if (nthreads > nchunks) nthreads = nchunks;
+	pthread_t *threads = malloc(sizeof(pthread_t) * (nthreads > 0 ? nthreads : 1));
+	for (int i = 0; i < nthreads; ++i) {
+		pthread_create(&threads[i], NULL, search_chunks, NULL);
+	}
+	for (size_t i = 0; i < nchunks; ++i) {
+		pthread_mutex_lock(&lock);
+		while (!chunks[i].done) pthread_cond_wait(&chunk_done, &lock);
+		pthread_mutex_unlock(&lock);
+		write_lines(&chunks[i].found);
+		free(chunks[i].found.lines);
+	}
+	for (int i = 0; i < nthreads; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+	free(chunks);
+
+	if (cannot_open) {
+		printf("wgrep: cannot open file\n");
+		exit(1);
+	}
+	return 0;
+}
+
+
+// Maps a file read-only and returns its contents, or NULL if it cannot be
+// opened. Files that cannot be mapped (pipes, terminals) are read instead,
+// as are those that report no size (/proc files) but may still have some.
+const char *map_file(const char *name, size_t *lenp) {
+	int fd = open(name, O_RDONLY);
+	struct stat sb;
+	if (fd < 0) return NULL;
+	if (fstat(fd, &sb) < 0) {
+		close(fd);
+		return NULL;
+	}
+
+	*lenp = 0;
+	if (S_ISREG(sb.st_mode) && sb.st_size > 0) {
+		*lenp = sb.st_size;
+		void *p = mmap(NULL, *lenp, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (p == MAP_FAILED) return NULL;
+		madvise(p, *lenp, MADV_SEQUENTIAL);
+		return p;
+	}
+
+	size_t cap = READ_SIZE;
+	char *buf = malloc(cap);
+	ssize_t n;
+	while ((n = read(fd, buf + *lenp, cap - *lenp)) > 0) {
+		*lenp += n;
+		if (*lenp == cap) buf = realloc(buf, cap *= 2);
+	}
+	close(fd);
+	return buf;
+}
+
+
+// Splits one input into chunks, moving each cut to just past a newline
+// so that no line is split between two chunks
+void add_chunks(const char *data, size_t len) {
+	size_t off = 0;
+	while (off < len) {
+		size_t end = len;
+		if (len - off > CHUNK_SIZE) {
+			const char *nl = memchr(data + off + CHUNK_SIZE, '\n', len - off - CHUNK_SIZE);
+			if (nl != NULL) end = nl + 1 - data;
+		}
+		if (nchunks == chunks_cap) {
+			chunks_cap = chunks_cap ? chunks_cap * 2 : 64;
+			chunks = realloc(chunks, sizeof(chunk_t) * chunks_cap);
+		}
+		chunk_t *c = &chunks[nchunks++];
+		c->p = data + off;
+		c->len = end - off;
+		c->found = (matches_t) { NULL, 0, 0 };
+		c->done = false;
+		off = end;
+	}
+}
+
+
+void *search_chunks(void *arg) {
+	while (true) {
+		pthread_mutex_lock(&lock);
+		if (next_chunk == nchunks) {
+			pthread_mutex_unlock(&lock);
+			return NULL;
+		}
+		chunk_t *c = &chunks[next_chunk++];
+		pthread_mutex_unlock(&lock);
+
+		grep_buffer(c->p, c->len, &c->found);
+
+		pthread_mutex_lock(&lock);
+		c->done = true;
+		pthread_cond_signal(&chunk_done);
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+
+// Adds the lines of p[0..len) holding the term to found. p starts a line.
+// The whole buffer is searched at once, and line boundaries are only
+// looked for around a match.
+void grep_buffer(const char *p, size_t len, matches_t *found) {
+	const char *s = p, *end = p + len, *m;
+	while (s < end && (m = find(s, end - s)) != NULL) {
+		const char *start = memrchr(s, '\n', m - s);
+		start = start ? start + 1 : s;
+		const char *nl = memchr(m + term_len, '\n', end - m - term_len);
+		s = nl ? nl + 1 : end;
+		add_line(found, start, s - start);
+	}
+}
+
+
+// Returns the first occurrence of the term in p[0..len), or NULL. A term
+// with a newline in it can never be inside a line, and the empty term is
+// in every line.
+const char *find(const char *p, size_t len) {
+	if (term_len == 0) return p;
+	if (memchr(term, '\n', term_len) != NULL || len < term_len) return NULL;
+	if (term_len == 1) return memchr(p, term[0], len);
+
+#ifdef __SSE2__
+	// Compare 16 positions at once against the term's first and last
+	// bytes; only where both agree is the middle compared. This throws
+	// out nearly every position for the cost of two loads and compares.
+	if (term_len <= LONG_TERM) {
+		__m128i first = _mm_set1_epi8(term[0]);
+		__m128i last = _mm_set1_epi8(term[term_len - 1]);
+		size_t i = 0;
+		for (; i + term_len - 1 + 16 <= len; i += 16) {
+			__m128i a = _mm_loadu_si128((const __m128i *) (p + i));
+			__m128i b = _mm_loadu_si128((const __m128i *) (p + i + term_len - 1));
+			unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+									_mm_cmpeq_epi8(b, last)));
+			while (mask != 0) {
+				int k = __builtin_ctz(mask);
+				if (memcmp(p + i + k + 1, term + 1, term_len - 2) == 0) return p + i + k;
+				mask &= mask - 1;
+			}
+		}
+		return memmem(p + i, len - i, term, term_len);
+	}
+#endif
+	return memmem(p, len, term, term_len);
+}
+
+
+void add_line(matches_t *found, const char *p, size_t len) {
+	if (found->nlines > 0) {
+		struct iovec *prev = &found->lines[found->nlines - 1];
+		if ((char *) prev->iov_base + prev->iov_len == p) {
+			prev->iov_len += len;
+			return;
+		}
+	}
+	if (found->nlines == found->cap) {
+		found->cap = found->cap ? found->cap * 2 : 64;
+		found->lines = realloc(found->lines, sizeof(struct iovec) * found->cap);
+	}
+	found->lines[found->nlines++] = (struct iovec) { (void *) p, len };
+}
+
+
+// Standard input may be a pipe of any length, so it is searched a buffer
+// at a time: everything up to the last newline read so far, with the
+// partial line after it kept for the next round
+void grep_stdin(void) {
+	size_t cap = READ_SIZE, have = 0;
+	char *buf = malloc(cap);
+	bool eof = false;
+	while (!eof) {
+		ssize_t n = read(STDIN_FILENO, buf + have, cap - have);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) eof = true;
+		else have += n;
+
+		size_t len = have;
+		if (!eof) {
+			const char *nl = memrchr(buf, '\n', have);
+			if (nl == NULL) {
+				// one line fills the buffer; make room for more of it
+				if (have == cap) buf = realloc(buf, cap *= 2);
+				continue;
+			}
+			len = nl + 1 - buf;
+		}
+
+		matches_t found = { NULL, 0, 0 };
+		grep_buffer(buf, len, &found);
+		write_lines(&found);
+		free(found.lines);
+		memmove(buf, buf + len, have - len);
+		have -= len;
+	}
+	free(buf);
+}
+
+
+void write_lines(matches_t *found) {
+	struct iovec *iov = found->lines;
+	int left = found->nlines;
+	while (left > 0) {
+		ssize_t n = writev(STDOUT_FILENO, iov, left < IOV_MAX ? left : IOV_MAX);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0) {
+			perror("wgrep: write");
+			exit(1);
+		}
+		// step over what went out, which may end partway into a line
+		while (left > 0 && (size_t) n >= iov->iov_len) {
+			n -= iov->iov_len;
+			++iov;
+			--left;
+		}
+		if (left > 0) {
+			iov->iov_base = (char *) iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+}
+
+
+void usage(void) {
+	printf("wgrep: searchterm [file ...]\n");
+	exit(1);
+}
@@ -0,0 +1,347 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysinfo.h>
+#include <unistd.h>
+
+#define RECORD 5                   // 4-byte run length + the character
+#define BLOCK_RECORDS (64 << 10)   // records expanded as one piece of work
+#define WINDOW_PER_THREAD 4        // blocks allowed ahead of the writer, per thread
+#define BIG_BLOCK (16 << 20)       // larger blocks are expanded by the writer
+#define OUT_BUF (4 << 20)          // expansion buffer when writing as we go
+#define SLACK 16                   // short runs are stored 16 bytes at a time
+
+// A run of whole records from one input, and what it expands to
+typedef struct {
+	const unsigned char *in;
+	size_t nrecords;
+	size_t out_len;     // bytes it expands to
+	off_t offset;       // where they go in the output
+	char *out;          // expanded bytes, when the writer puts them out
+	bool done;
+} block_t;
+
+const unsigned char *map_file(const char *, size_t *);
+void add_blocks(const unsigned char *, size_t);
+void run_threads(void *(*)(void *));
+void *sum_blocks(void *);
+void *expand_at_offsets(void *);
+void *expand_in_order(void *);
+block_t *claim_block(bool);
+void finish_block(block_t *);
+size_t expand(const unsigned char *, size_t, char *);
+void fill(char *, unsigned char, size_t);
+void stream_block(block_t *, char *, void (*)(block_t *, char *, size_t));
+void pwrite_piece(block_t *, char *, size_t);
+void write_piece(block_t *, char *, size_t);
+void write_all(const char *, size_t);
+void usage(void);
+
+block_t *blocks = NULL;
+size_t nblocks = 0, blocks_cap = 0;
+int nthreads;
+
+// next block to hand out, and (in order mode) the first one not yet
+// written; workers may only run window blocks ahead of the writer
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t block_done = PTHREAD_COND_INITIALIZER;
+pthread_cond_t window_open = PTHREAD_COND_INITIALIZER;
+size_t next_block = 0, written = 0, window = SIZE_MAX;
+
+
+int main(int argc, char *argv[]) {
+	if (argc < 2) usage();
+
+	// all inputs decompress to one stream; map them all up front
+	for (int i = 1; i < argc; ++i) {
+		size_t len;
+		const unsigned char *data = map_file(argv[i], &len);
+		if (data == NULL) {
+			printf("wunzip: cannot open file\n");
+			exit(1);
+		}
+		add_blocks(data, len);
+	}
+	nthreads = get_nprocs();
+	if (nthreads > nblocks) nthreads = nblocks;
+
+	// every record is 5 bytes, so blocks can be sized in parallel; a
+	// prefix sum then gives each block its place in the output
+	run_threads(sum_blocks);
+	off_t base = lseek(STDOUT_FILENO, 0, SEEK_CUR), total = 0;
+	for (size_t i = 0; i < nblocks; ++i) {
+		blocks[i].offset = base + total;
+		total += blocks[i].out_len;
+	}
+
+	// Into a regular file, every thread writes its blocks straight to
+	// their place. Anything else (a pipe, a terminal, a file opened for
+	// appending) takes the bytes in order only, so threads expand blocks
+	// ahead and this thread writes them out one after the other.
+	struct stat sb;
+	if (base >= 0 && fstat(STDOUT_FILENO, &sb) == 0 && S_ISREG(sb.st_mode)
+	    && !(fcntl(STDOUT_FILENO, F_GETFL) & O_APPEND)) {
+		next_block = 0;
+		run_threads(expand_at_offsets);
+		lseek(STDOUT_FILENO, base + total, SEEK_SET);
+		return 0;
+	}
+
+	next_block = 0;
+	window = (size_t) WINDOW_PER_THREAD * (nthreads > 0 ? nthreads : 1);
+	pthread_t *threads = malloc(sizeof(pthread_t) * (nthreads > 0 ? nthreads : 1));
+	for (int i = 0; i < nthreads; ++i) {
+		pthread_create(&threads[i], NULL, expand_in_order, NULL);
+	}
+	char *buf = malloc(OUT_BUF + SLACK);
+	for (size_t i = 0; i < nblocks; ++i) {
+		block_t *b = &blocks[i];
+		pthread_mutex_lock(&lock);
+		while (!b->done) pthread_cond_wait(&block_done, &lock);
+		pthread_mutex_unlock(&lock);
+
+		if (b->out != NULL) {
+			write_all(b->out, b->out_len);
+			free(b->out);
+		} else {
+			stream_block(b, buf, write_piece);
+		}
+
+		pthread_mutex_lock(&lock);
+		written = i + 1;
+		pthread_cond_broadcast(&window_open);
+		pthread_mutex_unlock(&lock);
+	}
+	for (int i = 0; i < nthreads; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+	free(buf);
+	free(threads);
+	free(blocks);
+	return 0;
+}
+
+
+// Maps a file read-only and returns its contents, or NULL if it cannot be
+// opened. Files that cannot be mapped (pipes, terminals) are read instead,
+// as are those that report no size (/proc files) but may still have some.
+const unsigned char *map_file(const char *name, size_t *lenp) {
+	int fd = open(name, O_RDONLY);
+	struct stat sb;
+	if (fd < 0) return NULL;
+	if (fstat(fd, &sb) < 0) {
+		close(fd);
+		return NULL;
+	}
+
+	*lenp = 0;
+	if (S_ISREG(sb.st_mode) && sb.st_size > 0) {
+		*lenp = sb.st_size;
+		void *p = mmap(NULL, *lenp, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (p == MAP_FAILED) return NULL;
+		madvise(p, *lenp, MADV_SEQUENTIAL);
+		return p;
+	}
+
+	size_t cap = OUT_BUF;
+	unsigned char *buf = malloc(cap);
+	ssize_t n;
+	while ((n = read(fd, buf + *lenp, cap - *lenp)) > 0) {
+		*lenp += n;
+		if (*lenp == cap) buf = realloc(buf, cap *= 2);
+	}
+	close(fd);
+	return buf;
+}
+
+
+// Splits one input into blocks of records; a partial record at the end
+// of a file is not a run and is dropped
+void add_blocks(const unsigned char *data, size_t len) {
+	size_t nrecords = len / RECORD;
+	for (size_t r = 0; r < nrecords; r += BLOCK_RECORDS) {
+		if (nblocks == blocks_cap) {
+			blocks_cap = blocks_cap ? blocks_cap * 2 : 64;
+			blocks = realloc(blocks, sizeof(block_t) * blocks_cap);
+		}
+		block_t *b = &blocks[nblocks++];
+		b->in = data + r * RECORD;
+		b->nrecords = nrecords - r < BLOCK_RECORDS ? nrecords - r : BLOCK_RECORDS;
+		b->out_len = 0;
+		b->out = NULL;
+		b->done = false;
+	}
+}
+
+
+void run_threads(void *(*start)(void *)) {
+	pthread_t threads[nthreads > 0 ? nthreads : 1];
+	for (int i = 0; i < nthreads; ++i) {
+		pthread_create(&threads[i], NULL, start, NULL);
+	}
+	for (int i = 0; i < nthreads; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+}
+
+
+void *sum_blocks(void *arg) {
+	block_t *b;
+	while ((b = claim_block(false)) != NULL) {
+		size_t sum = 0;
+		for (size_t r = 0; r < b->nrecords; ++r) {
+			uint32_t count;
+			memcpy(&count, b->in + r * RECORD, sizeof(count));
+			sum += count;
+		}
+		b->out_len = sum;
+	}
+	return NULL;
+}
+
+
+void *expand_at_offsets(void *arg) {
+	char *buf = malloc(OUT_BUF + SLACK);
+	block_t *b;
+	while ((b = claim_block(false)) != NULL) {
+		stream_block(b, buf, pwrite_piece);
+	}
+	free(buf);
+	return NULL;
+}
+
+
+void *expand_in_order(void *arg) {
+	block_t *b;
+	while ((b = claim_block(true)) != NULL) {
+		// a block of long runs is left to the writer, which streams it
+		// through its own buffer instead of holding it all in memory
+		if (b->out_len <= BIG_BLOCK) {
+			b->out = malloc(b->out_len + SLACK);
+			expand(b->in, b->nrecords, b->out);
+		}
+		finish_block(b);
+	}
+	return NULL;
+}
+
+
+// Hands out the next block, in order; NULL once all are taken. In order
+// mode, waits while the writer is a whole window behind.
+block_t *claim_block(bool in_order) {
+	block_t *b = NULL;
+	pthread_mutex_lock(&lock);
+	while (in_order && next_block < nblocks && next_block >= written + window) {
+		pthread_cond_wait(&window_open, &lock);
+	}
+	if (next_block < nblocks) b = &blocks[next_block++];
+	pthread_mutex_unlock(&lock);
+	return b;
+}
+
+
+void finish_block(block_t *b) {
+	pthread_mutex_lock(&lock);
+	b->done = true;
+	pthread_cond_signal(&block_done);
+	pthread_mutex_unlock(&lock);
+}
+
+
+// Expands records into out, which must have SLACK bytes to spare past
+// what they expand to; returns the bytes written
+size_t expand(const unsigned char *in, size_t nrecords, char *out) {
+	char *o = out;
+	for (size_t r = 0; r < nrecords; ++r, in += RECORD) {
+		uint32_t count;
+		memcpy(&count, in, sizeof(count));
+		fill(o, in[4], count);
+		o += count;
+	}
+	return o - out;
+}
+
+
+// memset, except that runs of up to 16 (most of them, in text) go in two
+// 8-byte stores instead of a call; o must have SLACK bytes to spare
+void fill(char *o, unsigned char c, size_t count) {
+	if (count <= SLACK) {
+		uint64_t pattern = 0x0101010101010101ULL * c;
+		memcpy(o, &pattern, sizeof(pattern));
+		memcpy(o + 8, &pattern, sizeof(pattern));
+	} else {
+		memset(o, c, count);
+	}
+}
+
+
+// Expands a block piece by piece through buf (OUT_BUF + SLACK bytes),
+// passing each piece to put in order; runs too long for buf are split
+// across pieces
+void stream_block(block_t *b, char *buf, void (*put)(block_t *, char *, size_t)) {
+	size_t used = 0;
+	for (size_t r = 0; r < b->nrecords; ++r) {
+		const unsigned char *rec = b->in + r * RECORD;
+		uint32_t count;
+		memcpy(&count, rec, sizeof(count));
+		while (count > 0) {
+			size_t n = count < OUT_BUF - used ? count : OUT_BUF - used;
+			fill(buf + used, rec[4], n);
+			used += n;
+			count -= n;
+			if (used == OUT_BUF) {
+				put(b, buf, used);
+				used = 0;
+			}
+		}
+	}
+	if (used > 0) put(b, buf, used);
+}
+
+
+void pwrite_piece(block_t *b, char *p, size_t len) {
+	while (len > 0) {
+		ssize_t n = pwrite(STDOUT_FILENO, p, len, b->offset);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0) {
+			perror("wunzip: write");
+			exit(1);
+		}
+		p += n;
+		len -= n;
+		b->offset += n;
+	}
+}
+
+
+void write_piece(block_t *b, char *p, size_t len) {
+	write_all(p, len);
+}
+
+
+void write_all(const char *p, size_t len) {
+	while (len > 0) {
+		ssize_t n = write(STDOUT_FILENO, p, len);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0) {
+			perror("wunzip: write");
+			exit(1);
+		}
+		p += n;
+		len -= n;
+	}
+}
+
+
+void usage(void) {
+	printf("wunzip: file1 [file2 ...]\n");
+	exit(1);
+}
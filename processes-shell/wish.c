@@ -1,24 +1,131 @@
+#define _GNU_SOURCE  // pipe2, F_SETPIPE_SZ, W_EXITCODE
+#include <errno.h>
 #include <fcntl.h>
+#include <spawn.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #define EXIT "exit"
 #define PATH "path"
 #define CD "cd"
+#define TIME "time"
 #define DEFAULT_PATH "/bin"
+#define CACHE_BUCKETS 256
+#define PIPE_SIZE (1 << 20)    // pipe buffer asked for between stages
+
+// what each byte of a line is to the lexer; anything not listed is part
+// of a word, and END, BG, SEQ and PIPE are also what ends a command
+enum { T_WORD, T_BLANK, T_REDIR, T_END, T_BG, T_SEQ, T_PIPE };
+
+static const unsigned char char_type[256] = {
+	[' '] = T_BLANK, ['\t'] = T_BLANK, ['\n'] = T_BLANK,
+	['>'] = T_REDIR, ['&'] = T_BG, [';'] = T_SEQ, ['|'] = T_PIPE,
+	['\0'] = T_END,
+};
+
+// one command of a line; argv and out point into the line's arena
+typedef struct {
+	char **argv;
+	size_t argc;
+	char *out;      // file after '>', or NULL
+	int sep;        // T_BG, T_SEQ, T_PIPE or T_END: what came after it
+	bool bad;       // '>' used other than as "cmd ... > file", or an
+	                // empty stage of a pipeline
+	pid_t pid;      // child running it, until it is waited for
+	int status;     // how the child ended, once waited for
+	struct rusage ru;
+	// kept on the first command of a job only
+	bool timed;     // the job was run under 'time'
+	double start;   // when it was started
+	long timing;    // its entry in timings, or -1
+} cmd_t;
+
+// What a finished job cost: its wall time, and what its children used
+// (as wait4 reports it) added up
+typedef struct {
+	double secs, user, sys;
+	long maxrss;            // in KB, of the biggest child
+	long minflt, majflt;    // page faults without and with I/O
+	long nvcsw, nivcsw;     // context switches given up and forced
+	int status;             // exit status of the last command
+} usage_t;
+
+// Memory for everything parsed from one line, handed out front to back
+// and taken back all at once before the next line is read
+typedef struct {
+	char *base;
+	size_t cap, used;
+} arena_t;
+
+// a line read with -j, and how far through it the scheduler has got
+typedef struct line {
+	arena_t arena;
+	cmd_t *cmds;
+	size_t ncmds;
+	size_t pos;         // first command not yet started
+	size_t running;     // its jobs still running
+	size_t lineno;
+	struct line *next;
+} line_t;
+
+// a pipeline (or a single command) running with -j
+typedef struct {
+	line_t *line;
+	cmd_t *first, *last;
+	size_t left;        // its children not yet waited for
+} job_t;
+
+// a job started with -j or -p, for the summary or profile at the end
+typedef struct {
+	size_t lineno;
+	char *text;
+	double start;
+	usage_t u;
+} timing_t;
+
+// a command name and the file it was found as on the path
+typedef struct cache_entry {
+	char *cmd;
+	char *file;
+	struct cache_entry *next;
+} cache_entry_t;
+
+extern char **environ;
+cache_entry_t *cmd_cache[CACHE_BUCKETS];
+timing_t *timings = NULL;
+size_t ntimings = 0, timings_cap = 0;
+bool recording = false;
+const char *profile = NULL;
+double run_start;
 
 // TODO move to header file
 char *prepend(const char *restrict, const char *restrict, const char *);
-char *redirect(char **);
-char **get_next_args(char ***, size_t *);
-char **tokenize(const char *, const char *, const char *);
+char *resolve(const char *, char **);
+size_t lex(const char *, size_t, arena_t *, cmd_t **);
+void arena_reset(arena_t *, size_t);
+void *arena_alloc(arena_t *, size_t);
 FILE get_output(int *, const char **argv);
-int execute(char **, char **);
-size_t count_args(const char *, const char *, const char *); 
-void cmd_exit(char **, char *, size_t);
+void run_job(cmd_t *, cmd_t *, char ***, bool, size_t);
+void run_parallel(FILE *, size_t, char ***, bool);
+bool is_builtin(cmd_t *, cmd_t *);
+void job_done(cmd_t *, cmd_t *);
+void print_usage(usage_t *);
+size_t start_timing(size_t, cmd_t *, cmd_t *);
+void print_timings(size_t, double);
+void write_profile(void);
+void write_quoted(FILE *, const char *, bool);
+double now(void);
+void run_pipeline(cmd_t *, cmd_t *, char **, bool);
+int launch(cmd_t *, char **, int, int, pid_t);
+void wait_cmds(cmd_t *, cmd_t *);
+void cache_clear(void);
+void cmd_exit(size_t);
 void cmd_cd(char **, size_t);
 void cmd_path(char ***, char **, size_t);
 void err_routine(bool);
@@ -29,13 +136,27 @@ int main(int argc, char *argv[]) {
 	char *line = NULL;
 	size_t linecap = 0;
 	int linelen = 0;
-	const char *delims = " \t\n";
-	const char *ops = ">&;";
+	arena_t arena = { NULL, 0, 0 };
 	// TODO move fp logic to function `get_output`
 	FILE *fp = stdin;
 
-	// special case: batch mode
+	// special case: batch mode, maybe with -j N jobs at a time, and -p
+	// FILE to write what each job cost to
 	bool batch = false;
+	long njobs = 0;
+	while (argc > 2 && argv[1][0] == '-') {
+		if (strcmp(argv[1], "-j") == 0) {
+			njobs = strtol(argv[2], NULL, 10);
+			if (njobs < 1) err_routine(true);
+		} else if (strcmp(argv[1], "-p") == 0) {
+			profile = argv[2];
+		} else {
+			err_routine(true);
+		}
+		argc -= 2;
+		argv += 2;
+	}
+	if ((njobs > 0 || profile != NULL) && argc != 2) err_routine(true);
 	switch (argc) {
 		case 1:
 			break;
@@ -54,63 +175,364 @@ int main(int argc, char *argv[]) {
 	}
 
 	// initialize path
-	char **path = tokenize(DEFAULT_PATH, delims, ops);
+	char *default_path[] = { PATH, DEFAULT_PATH, NULL };
+	char **path = NULL;
+	cmd_path(&path, default_path, 2);
+
+	// the profile is written however the shell exits
+	run_start = now();
+	recording = njobs > 0 || profile != NULL;
+	if (profile != NULL) atexit(write_profile);
+
+	// jobs get process groups of their own only away from a terminal:
+	// the shell does not hand it over, so a job outside its group would
+	// be stopped by SIGTTIN on reading it, and miss ^C
+	bool own_group = batch && !isatty(STDIN_FILENO);
+
+	if (njobs > 0) {
+		run_parallel(fp, njobs, &path, own_group);
+		exit(0);
+	}
 
 	// run commands
-	char **tokens = malloc(0);
-	tokens[0] = NULL;
+	size_t lineno = 0;
 	while (true) {
-		free_tokens(tokens);
 		if (!batch) printf("wish> ");
 		if ((linelen = getline(&line, &linecap, fp)) < 0) {
 			free_tokens(path);
+			free(arena.base);
+			free(line);
 			exit(0);
 		}	
 
-		tokens = tokenize(line, delims, ops);
-		char **tokens_cpy = tokens;
-		char **args;
-		size_t nargs = 0;
-		while ((args = get_next_args(&tokens_cpy, &nargs)) != NULL) {
-			if (nargs == 0) continue;
-			char *cmd = args[0]; 
-
-			// first check for built-ins
-			if (strcmp(cmd, EXIT) == 0) {
-				cmd_exit(args, line, nargs);	
-			} else if (strcmp(cmd, CD) == 0) {
-				cmd_cd(args, nargs);
-			} else if (strcmp(cmd, PATH) == 0) {
-				cmd_path(&path, args, nargs);
-			}
+		cmd_t *cmds;
+		size_t ncmds = lex(line, linelen, &arena, &cmds);
+		++lineno;
+		cmd_t *c = cmds;
+		while (c < cmds + ncmds) {
+			// commands joined by '|' run together as one job
+			cmd_t *last = c;
+			while (last->sep == T_PIPE) ++last;
 
-			// not a built-in command, call from path
-			else {
-				int rc = fork();
-				if (rc < 0) {
-					err_routine(true);
-				}
-				// child [DEBUG: parent]
-				else if (rc == 0) {
-					if ((execute(args, path) == -1)) {
-						free_tokens(tokens);
-						err_routine(true);
+			run_job(c, last, &path, own_group, lineno);
+
+			// ';' runs what follows once everything before it is done
+			if (last->sep == T_SEQ) wait_cmds(cmds, last + 1);
+			c = last + 1;
+		}
+		wait_cmds(cmds, cmds + ncmds);
+	}
+}
+
+
+// Runs the commands first..last (more than one if joined by '|') without
+// waiting for them, or reports what is wrong with them
+void run_job(cmd_t *first, cmd_t *last, char ***pathp, bool own_group, size_t lineno) {
+	cmd_t *c = first;
+	first->start = now();
+	if (last > first) {
+		run_pipeline(first, last, *pathp, own_group);
+	} else if (c->bad) {
+		err_routine(false);
+	} else if (c->argc == 0) {
+		// nothing to run, as around a lone '&'
+	}
+
+	// first check for built-ins
+	else if (strcmp(c->argv[0], EXIT) == 0) {
+		cmd_exit(c->argc);	
+	} else if (strcmp(c->argv[0], CD) == 0) {
+		cmd_cd(c->argv, c->argc);
+	} else if (strcmp(c->argv[0], PATH) == 0) {
+		cmd_path(pathp, c->argv, c->argc);
+	}
+
+	// not a built-in command, call from path
+	else if (launch(c, *pathp, -1, -1, own_group ? 0 : -1) < 0) {
+		err_routine(false);
+	}
+
+	bool started = false;
+	for (c = first; c <= last; ++c) {
+		if (c->pid > 0) started = true;
+	}
+	if (started && recording) {
+		first->timing = start_timing(lineno, first, last);
+	} else if (!started && first->timed && !first->bad) {
+		// a timed built-in is done already
+		job_done(first, last);
+	}
+}
+
+
+// Runs a batch file with up to n jobs at once, across lines: lines are
+// taken to be independent, so a job starts as soon as a slot is free,
+// without waiting for the lines before it to finish. Within a line,
+// what follows a ';' still waits for the rest of the line before it.
+// A built-in waits until nothing else is running, and nothing after it
+// starts until it has run, since cd and path change how later commands
+// run. Prints how long each job took, and the whole run, to stderr.
+void run_parallel(FILE *fp, size_t n, char ***pathp, bool own_group) {
+	job_t *slots = calloc(n, sizeof(job_t));
+	size_t running = 0, lineno = 0;
+	line_t *lines = NULL, *spare = NULL;
+	char *buf = NULL;
+	size_t bufcap = 0;
+	bool eof = false;
+
+	while (true) {
+		// start whatever can be started, oldest line first
+		bool blocked = false;
+		line_t **lp = &lines;
+		while (*lp != NULL && !blocked) {
+			line_t *l = *lp;
+			while (running < n && l->pos < l->ncmds) {
+				cmd_t *c = &l->cmds[l->pos];
+				if (l->pos > 0 && c[-1].sep == T_SEQ && l->running > 0) break;
+				cmd_t *last = c;
+				while (last->sep == T_PIPE) ++last;
+
+				if (is_builtin(c, last)) {
+					if (l != lines || running > 0) {
+						blocked = true;
+						break;
 					}
+					if (strcmp(c->argv[0], EXIT) == 0 && c->argc == 1) {
+						print_timings(n, now() - run_start);
+						exit(0);
+					}
+				}
+				run_job(c, last, pathp, own_group, l->lineno);
+				l->pos = last - l->cmds + 1;
+
+				size_t left = 0;
+				for (cmd_t *s = c; s <= last; ++s) {
+					if (s->pid > 0) ++left;
+				}
+				if (left > 0) {
+					job_t *j = slots;
+					while (j->left > 0) ++j;
+					*j = (job_t) { l, c, last, left };
+					++running;
+					++l->running;
 				}
 			}
+
+			// a line is done once all of it has started and finished;
+			// its memory is kept for a line read later
+			if (l->pos == l->ncmds && l->running == 0) {
+				*lp = l->next;
+				l->next = spare;
+				spare = l;
+			} else {
+				lp = &l->next;
+			}
 		}
-		// parent: wait for ALL child processes
-		while (wait(NULL) > 0);
+
+		// with a slot to spare, read another line
+		if (running < n && !blocked && !eof) {
+			ssize_t len = getline(&buf, &bufcap, fp);
+			if (len < 0) {
+				eof = true;
+				continue;
+			}
+			line_t *l = spare;
+			if (l != NULL) {
+				spare = l->next;
+			} else {
+				l = calloc(1, sizeof(line_t));
+			}
+			l->ncmds = lex(buf, len, &l->arena, &l->cmds);
+			l->pos = 0;
+			l->running = 0;
+			l->lineno = ++lineno;
+			l->next = NULL;
+			for (lp = &lines; *lp != NULL; lp = &(*lp)->next);
+			*lp = l;
+			continue;
+		}
+		if (running == 0) break;
+
+		// wait for any child, and free its job's slot once the last of
+		// the job has exited
+		int status;
+		struct rusage ru;
+		pid_t pid = wait4(-1, &status, 0, &ru);
+		if (pid < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		for (job_t *j = slots; j < slots + n; ++j) {
+			if (j->left == 0) continue;
+			for (cmd_t *s = j->first; s <= j->last; ++s) {
+				if (s->pid != pid) continue;
+				s->pid = 0;
+				s->status = status;
+				s->ru = ru;
+				if (--j->left == 0) {
+					job_done(j->first, j->last);
+					--running;
+					--j->line->running;
+				}
+			}
+		}
+	}
+	print_timings(n, now() - run_start);
+}
+
+
+// Adds up what the children of a finished job used; prints it if the job
+// was run under 'time', and keeps it if jobs are being recorded
+void job_done(cmd_t *first, cmd_t *last) {
+	usage_t u = { now() - first->start };
+	for (cmd_t *c = first; c <= last; ++c) {
+		u.user += c->ru.ru_utime.tv_sec + c->ru.ru_utime.tv_usec / 1e6;
+		u.sys += c->ru.ru_stime.tv_sec + c->ru.ru_stime.tv_usec / 1e6;
+		if (c->ru.ru_maxrss > u.maxrss) u.maxrss = c->ru.ru_maxrss;
+		u.minflt += c->ru.ru_minflt;
+		u.majflt += c->ru.ru_majflt;
+		u.nvcsw += c->ru.ru_nvcsw;
+		u.nivcsw += c->ru.ru_nivcsw;
+	}
+	u.status = WIFEXITED(last->status) ? WEXITSTATUS(last->status)
+		: 128 + WTERMSIG(last->status);
+
+	if (first->timed) print_usage(&u);
+	if (first->timing >= 0) timings[first->timing].u = u;
+}
+
+
+void print_usage(usage_t *u) {
+	fprintf(stderr, "real %.3fs  user %.3fs  sys %.3fs  maxrss %ldKB  "
+			"faults %ld+%ld  switches %ld+%ld\n", u->secs, u->user, u->sys,
+			u->maxrss, u->minflt, u->majflt, u->nvcsw, u->nivcsw);
+}
+
+
+bool is_builtin(cmd_t *first, cmd_t *last) {
+	return last == first && !first->bad && first->argc > 0
+		&& (strcmp(first->argv[0], EXIT) == 0 || strcmp(first->argv[0], CD) == 0
+		    || strcmp(first->argv[0], PATH) == 0);
+}
+
+
+// Notes that a job has started, keeping its words for the summary (its
+// line's memory is reused); returns its entry in timings
+size_t start_timing(size_t lineno, cmd_t *first, cmd_t *last) {
+	size_t len = 1;
+	for (cmd_t *c = first; c <= last; ++c) {
+		for (size_t i = 0; i < c->argc; ++i) len += strlen(c->argv[i]) + 1;
+		if (c->out != NULL) len += strlen(c->out) + 3;
+		len += 2;
+	}
+	char *text = malloc(len);
+	text[0] = '\0';
+	for (cmd_t *c = first; c <= last; ++c) {
+		if (c > first) strcat(text, "| ");
+		for (size_t i = 0; i < c->argc; ++i) {
+			strcat(text, c->argv[i]);
+			strcat(text, " ");
+		}
+		if (c->out != NULL) {
+			strcat(text, "> ");
+			strcat(text, c->out);
+			strcat(text, " ");
+		}
+	}
+	text[strlen(text) - 1] = '\0';
+
+	if (ntimings == timings_cap) {
+		timings_cap = timings_cap ? timings_cap * 2 : 64;
+		timings = realloc(timings, sizeof(timing_t) * timings_cap);
+	}
+	timings[ntimings] = (timing_t) { lineno, text, first->start - run_start };
+	return ntimings++;
+}
+
+
+void print_timings(size_t n, double wall) {
+	for (size_t i = 0; i < ntimings; ++i) {
+		fprintf(stderr, "%9.3fs  line %zu: %s\n", timings[i].u.secs,
+				timings[i].lineno, timings[i].text);
 	}
+	fprintf(stderr, "%9.3fs  total: %zu jobs, at most %zu at a time\n",
+			wall, ntimings, n);
 }
 
 
-void cmd_exit(char **tokens, char *line, size_t nargs) {
+// Writes a record of every job to the -p file: as JSON if its name ends
+// in ".json", and as CSV otherwise. Times are in seconds, with start
+// counted from when the shell started.
+void write_profile(void) {
+	FILE *out = fopen(profile, "w");
+	if (out == NULL) {
+		err_routine(false);
+		return;
+	}
+	size_t len = strlen(profile);
+	bool json = len >= 5 && strcmp(profile + len - 5, ".json") == 0;
+
+	if (json) {
+		fprintf(out, "[\n");
+	} else {
+		fprintf(out, "line,command,start,wall,user,sys,maxrss_kb,"
+				"minflt,majflt,nvcsw,nivcsw,status\n");
+	}
+	for (size_t i = 0; i < ntimings; ++i) {
+		timing_t *t = &timings[i];
+		usage_t *u = &t->u;
+		if (json) {
+			fprintf(out, "  {\"line\": %zu, \"command\": ", t->lineno);
+			write_quoted(out, t->text, true);
+			fprintf(out, ", \"start\": %.6f, \"wall\": %.6f, \"user\": %.6f, "
+					"\"sys\": %.6f, \"maxrss_kb\": %ld, \"minflt\": %ld, "
+					"\"majflt\": %ld, \"nvcsw\": %ld, \"nivcsw\": %ld, "
+					"\"status\": %d}%s\n", t->start, u->secs, u->user, u->sys,
+					u->maxrss, u->minflt, u->majflt, u->nvcsw, u->nivcsw,
+					u->status, i + 1 < ntimings ? "," : "");
+		} else {
+			fprintf(out, "%zu,", t->lineno);
+			write_quoted(out, t->text, false);
+			fprintf(out, ",%.6f,%.6f,%.6f,%.6f,%ld,%ld,%ld,%ld,%ld,%d\n",
+					t->start, u->secs, u->user, u->sys, u->maxrss, u->minflt,
+					u->majflt, u->nvcsw, u->nivcsw, u->status);
+		}
+	}
+	if (json) fprintf(out, "]\n");
+	fclose(out);
+}
+
+
+// Writes s in double quotes, escaped for JSON or (doubling quotes) CSV
+void write_quoted(FILE *out, const char *s, bool json) {
+	fputc('"', out);
+	for (; *s != '\0'; ++s) {
+		if (!json) {
+			if (*s == '"') fputc('"', out);
+			fputc(*s, out);
+		} else if (*s == '"' || *s == '\\') {
+			fprintf(out, "\\%c", *s);
+		} else if ((unsigned char) *s < 0x20) {
+			fprintf(out, "\\u%04x", *s);
+		} else {
+			fputc(*s, out);
+		}
+	}
+	fputc('"', out);
+}
+
+
+double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+void cmd_exit(size_t nargs) {
 	if (nargs > 1) {
 		err_routine(false);
 	} else {
-		free_tokens(tokens);
-		free(line);
 		exit(0);
 	}
 }
@@ -120,17 +542,20 @@ void cmd_cd(char **tokens, size_t nargs) {
 	if (nargs != 2 || chdir(tokens[1]) < 0) {
 		err_routine(false);
 	}
+	// relative path directories now point somewhere else
+	cache_clear();
 }
 
 
 void cmd_path(char ***pathp, char **tokens, size_t nargs) {
-	free_tokens(*pathp);
+	if (*pathp != NULL) free_tokens(*pathp);
 	char **path = malloc(sizeof(char *) * nargs);
 	for (int i = 0; i < nargs - 1; ++i) { 
 		path[i] = strdup(tokens[i + 1]); 
 	}
 	path[nargs - 1] = NULL;
 	*pathp = path;
+	cache_clear();
 }
 
 
@@ -141,178 +566,283 @@ void err_routine(bool call_exit) {
 }
 
 
-int execute(char **args, char **path) {	
-	// handle redirection
-	char *out;
-	if ((out = redirect(args)) != NULL) {
-		int fd = open(out, O_WRONLY | O_TRUNC | O_CREAT);
-		// redirect stdout in to file
-		if (fd < 0 || (fd = dup2(fd, STDOUT_FILENO) < 0 )) err_routine(true);
+// Starts the stages first..last of a pipeline, each writing into a pipe
+// the next one reads from, all at once so the data streams through
+// memory. With own_group the stages share a process group of their own,
+// the first stage's, so the job can be signalled as one; otherwise they
+// stay in the shell's group, which owns the terminal.
+void run_pipeline(cmd_t *first, cmd_t *last, char **path, bool own_group) {
+	for (cmd_t *c = first; c <= last; ++c) {
+		if (c->bad) {
+			err_routine(false);
+			return;
+		}
 	}
 
-	for (char **p = path; *p != NULL; ++p) {
-		char *prepended = prepend(args[0], *p, "/");
-		if (access(prepended, X_OK) == 0) {
-			// args must contain *p
-			free(args[0]);
-			args[0] = prepended;
-			return execv(args[0], args);
+	pid_t pgid = own_group ? 0 : -1;
+	int in = -1;
+	for (cmd_t *c = first; c <= last; ++c) {
+		// close-on-exec, so that only the stages meant to get an end
+		// of a pipe (as stdin or stdout) hold it open
+		int fds[2] = { -1, -1 };
+		if (c < last) {
+			if (pipe2(fds, O_CLOEXEC) < 0) {
+				err_routine(false);
+				break;
+			}
+			// a bigger buffer lets the writer run further ahead; if it
+			// is over the limit the default one is fine
+			fcntl(fds[1], F_SETPIPE_SZ, PIPE_SIZE);
 		}
-		free(prepended);
+
+		if (launch(c, path, in, fds[1], pgid) < 0) {
+			err_routine(false);
+		} else if (pgid == 0) {
+			pgid = c->pid;
+		}
+		if (in >= 0) close(in);
+		if (fds[1] >= 0) close(fds[1]);
+		in = fds[0];
+	}
+	if (in >= 0) close(in);
+}
+
+
+// Starts a command as a child without waiting for it, with in and out
+// (unless -1) as its stdin and stdout; a '>' file takes the place of
+// out. The child goes into process group pgid (0 for a new one of its
+// own) unless that is -1. Returns -1 (nothing started) if the command is
+// not on the path.
+//
+// posix_spawn lets the C library use vfork, so nothing of the shell is
+// copied just to be replaced by execve, and the redirection is done by
+// file actions in the child rather than by code of ours between the two.
+int launch(cmd_t *c, char **path, int in, int out, pid_t pgid) {
+	char *file = resolve(c->argv[0], path);
+	if (file == NULL) {
+		c->status = W_EXITCODE(127, 0);
+		return -1;
 	}
 
-	return -1;
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	if (in >= 0) posix_spawn_file_actions_adddup2(&actions, in, STDIN_FILENO);
+	if (out >= 0) posix_spawn_file_actions_adddup2(&actions, out, STDOUT_FILENO);
+	if (c->out != NULL) {
+		posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, c->out,
+				O_WRONLY | O_TRUNC | O_CREAT, 0666);
+	}
+	posix_spawnattr_t attr;
+	posix_spawnattr_init(&attr);
+	if (pgid >= 0) {
+		posix_spawnattr_setpgroup(&attr, pgid);
+		posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+	}
+	int rc = posix_spawn(&c->pid, file, &actions, &attr, c->argv, environ);
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+	if (rc != 0) {
+		c->pid = 0;
+		c->status = W_EXITCODE(127, 0);
+		return -1;
+	}
+	return 0;
 }
 
 
-char **get_next_args(char ***tokensp, size_t *nargs) {
-	if (**tokensp == NULL) {
-		return NULL;
-	}
-
-	// count args
-	char **start = *tokensp;
-	*nargs = 0;
-	for (char **stop = start; strcmp(*stop, "&") != 0; ++stop) {
-		*nargs += 1;
-		if (*(stop + 1) == NULL) break;			
-	}	
-	
-	// copy args	
-	char **args = malloc(sizeof(char *) * (*nargs + 1));
-	for (int i = 0; i < *nargs; ++i) {
-		args[i] = strdup(**tokensp);	
-		*tokensp += 1;
-	}
-	args[*nargs] = NULL;
-	
-	// advance tokens pointer past "&"
-	if (**tokensp != NULL) *tokensp += 1;
-	
-	return args;
+// Waits for the children started for the commands from..to (whole jobs),
+// taking each as it exits rather than in command order, so a job's wall
+// time ends when its last child does, not when the shell gets round to it
+void wait_cmds(cmd_t *from, cmd_t *to) {
+	size_t left = 0;
+	for (cmd_t *c = from; c < to; ++c) {
+		if (c->pid > 0) ++left;
+	}
+	while (left > 0) {
+		int status;
+		struct rusage ru;
+		pid_t pid = wait4(-1, &status, 0, &ru);
+		if (pid < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		cmd_t *first = from;
+		while (first < to) {
+			cmd_t *last = first;
+			while (last->sep == T_PIPE) ++last;
+
+			bool running = false, found = false;
+			for (cmd_t *c = first; c <= last; ++c) {
+				if (c->pid == pid) {
+					c->pid = 0;
+					c->status = status;
+					c->ru = ru;
+					found = true;
+					--left;
+				} else if (c->pid > 0) {
+					running = true;
+				}
+			}
+			if (found) {
+				if (!running) job_done(first, last);
+				break;
+			}
+			first = last + 1;
+		}
+	}
 }
 
 
-char *redirect(char **args) {
-	// count number of args by locating NULL pointer
-	size_t nargs = 0;
-	for (char **p = args; *p != NULL; p++) {
-		nargs++;
+// Finds the file a command runs from: the first directory on the path
+// holding it as an executable. Answers are cached until the path or the
+// working directory changes, so a batch file running the same commands
+// over and over searches the path once per command.
+char *resolve(const char *cmd, char **path) {
+	unsigned long h = 5381;
+	for (const char *c = cmd; *c != '\0'; ++c) {
+		h = h * 33 + (unsigned char) *c;
+	}
+	cache_entry_t **bucket = &cmd_cache[h % CACHE_BUCKETS];
+	for (cache_entry_t *e = *bucket; e != NULL; e = e->next) {
+		if (strcmp(e->cmd, cmd) == 0) return e->file;
 	}
 
-	// ensure '>' only allowed if at least two args, and only second to last
-	for (int i = 0; i < nargs; ++i) {
-		if (strcmp(args[i], ">") == 0 && (nargs < 3 || i != nargs - 2)) {
-			err_routine(true);
+	for (char **p = path; *p != NULL; ++p) {
+		char *prepended = prepend(cmd, *p, "/");
+		if (access(prepended, X_OK) == 0) {
+			cache_entry_t *e = malloc(sizeof(cache_entry_t));
+			e->cmd = strdup(cmd);
+			e->file = prepended;
+			e->next = *bucket;
+			*bucket = e;
+			return prepended;
 		}
-	}	
-	// check that penultimate arg is '>'
-	if (nargs < 3 || strcmp(args[nargs - 2], ">") != 0) {
-		return NULL;
-	}	
-
-	// remove "> [out]" from args
-	char *out = strdup(args[nargs - 1]);
-	free(args[nargs - 1]);
-	free(args[nargs - 2]);
-	args[nargs - 1] = NULL;
-	args[nargs - 2] = NULL;
-
-	// output to last arg
-	return out;
-
+		free(prepended);
+	}
+	return NULL;
 }
 
 
-char *prepend(const char *restrict base, const char *restrict prefix,
-		const char *sep) {
-	char *s = malloc(strlen(prefix) + strlen(sep)+ strlen(base) + 1);
-	strcpy(s, prefix);
-	strcat(s, sep);
-	strcat(s, base);
-
-	return s;
+void cache_clear(void) {
+	for (int i = 0; i < CACHE_BUCKETS; ++i) {
+		while (cmd_cache[i] != NULL) {
+			cache_entry_t *e = cmd_cache[i];
+			cmd_cache[i] = e->next;
+			free(e->cmd);
+			free(e->file);
+			free(e);
+		}
+	}
 }
 
-char **tokenize(const char *line, const char *delims, const char *operators) {
-
-	size_t nargs = count_args(line, delims, operators);	
-
-	// tokenize args 
-	char **tokens = malloc(sizeof(char *) * (nargs + 1));
-	int token_index = 0;
-	bool in_word = false;
-	const char *start = line;
-	const char *end = line;
-	while (*end != '\0') {
-		// delimiter encountered
-		if (strchr(delims, *end) != NULL) {
-			// previously in word, make new token
-			if (in_word) {
-				tokens[token_index++] = strndup(start, end - start);
-				in_word = false;
-				start = end + 1;
-			} 
-			// not in word, advance start
-			else {
-				start++;
+
+// Splits a line into commands in one pass over it, copying each word
+// into the arena with a '\0' after it and pointing the commands' argv at
+// the copies. Returns the number of commands (at least one, maybe empty)
+// and points *cmdsp at them; all of it lasts until the next line.
+size_t lex(const char *line, size_t len, arena_t *a, cmd_t **cmdsp) {
+	// a line of len bytes has at most len + 1 commands and (len + 1) / 2
+	// words, and the copies take a byte more per word than the line did
+	size_t max_cmds = len + 1;
+	arena_reset(a, sizeof(cmd_t) * max_cmds + sizeof(char *) * (len + 1 + max_cmds)
+			+ 2 * len + 1 + 2 * sizeof(void *));
+	cmd_t *cmds = arena_alloc(a, sizeof(cmd_t) * max_cmds);
+	char **argv = arena_alloc(a, sizeof(char *) * (len + 1 + max_cmds));
+	char *text = arena_alloc(a, 2 * len + 1);
+
+	size_t ncmds = 0;
+	cmd_t *c = &cmds[0];
+	*c = (cmd_t) { .argv = argv, .sep = T_END, .timing = -1 };
+	bool want_out = false;
+	const char *p = line;
+	while (true) {
+		int type = char_type[(unsigned char) *p];
+		if (type == T_WORD) {
+			char *word = text;
+			do {
+				*text++ = *p++;
+			} while (char_type[(unsigned char) *p] == T_WORD);
+			*text++ = '\0';
+
+			// 'time' before a job asks for what it cost
+			bool piped = ncmds > 0 && cmds[ncmds - 1].sep == T_PIPE;
+			if (c->argc == 0 && !c->timed && !want_out && !piped
+			    && strcmp(word, TIME) == 0) {
+				c->timed = true;
+				continue;
 			}
-		} 
-		// operator encountered
-		else if (strchr(operators, *end) != NULL) {
-			// previously in word, make new token
-			if (in_word) {
-				tokens[token_index++] = strndup(start, end - start);
-				in_word = false;
+
+			// after '>' comes the one file name, and nothing else
+			if (c->out != NULL) {
+				c->bad = true;
+			} else if (want_out) {
+				c->out = word;
+			} else {
+				*argv++ = word;
+				c->argc++;
 			}
-			// add operator itself to tokens 
-			start = end;
-			tokens[token_index++] = strndup(start, 1);
-			start = end + 1;
+			continue;
 		}
-		// alphanumeric encountered
-		else {
-			in_word = true;
+		if (type == T_BLANK) {
+			++p;
+			continue;
+		}
+		if (type == T_REDIR) {
+			if (want_out) c->bad = true;
+			want_out = true;
+			++p;
+			continue;
 		}
-		end++;
-	}
-	// append final token
-	if (in_word) {
-		tokens[token_index++] = strndup(start, end - start);
-	}	
 
-	tokens[token_index] = NULL; 
-	return tokens;
+		// anything else ends the command
+		*argv++ = NULL;
+		if (want_out && (c->out == NULL || c->argc == 0)) c->bad = true;
+		// a pipe needs a command on either side of it
+		bool piped = ncmds > 0 && cmds[ncmds - 1].sep == T_PIPE;
+		if ((type == T_PIPE || piped || c->timed) && c->argc == 0) c->bad = true;
+		c->sep = type;
+		++ncmds;
+		if (type == T_END || p == line + len) break;
+		++p;
+		c = &cmds[ncmds];
+		*c = (cmd_t) { .argv = argv, .sep = T_END, .timing = -1 };
+		want_out = false;
+	}
+	*cmdsp = cmds;
+	return ncmds;
 }
 
 
-size_t count_args(const char *line, const char *delims, const char *ops) {
-	char delims_and_ops[strlen(delims) + strlen(ops) + 1];
-	strcpy(delims_and_ops, delims);
-	strcat(delims_and_ops, ops);
-
-	// count number of non-operator args 
-	size_t nargs = 0;
-	const char *p = line;
-	// skip any initial whitespace
-	p += strspn(p, delims_and_ops);
-	while (*p != '\0') {
-		p += strcspn(p, delims_and_ops);
-		p += strspn(p, delims_and_ops);
-		nargs += 1;
+// Takes back everything handed out, making sure there is room for need
+// bytes; the memory itself is kept for the next line
+void arena_reset(arena_t *a, size_t need) {
+	if (need > a->cap) {
+		free(a->base);
+		a->cap = need > 2 * a->cap ? need : 2 * a->cap;
+		a->base = malloc(a->cap);
 	}
+	a->used = 0;
+}
 
-	// count number of operators
-	p = strpbrk(line, ops);
-	while (p != NULL) {
-		nargs += 1;
-		p = strpbrk(p + 1, ops);
-	}
 
-	return nargs;
+void *arena_alloc(arena_t *a, size_t n) {
+	a->used = (a->used + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	void *p = a->base + a->used;
+	a->used += n;
+	return p;
 }
 
 
+char *prepend(const char *restrict base, const char *restrict prefix,
+		const char *sep) {
+	char *s = malloc(strlen(prefix) + strlen(sep)+ strlen(base) + 1);
+	strcpy(s, prefix);
+	strcat(s, sep);
+	strcat(s, base);
+
+	return s;
+}
+
 void free_tokens(char **tokens) {
 	for (char **p = tokens; *p != NULL; p++) {
 		free(*p);